@@ -0,0 +1,565 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+/*
+ * Load generator for aesdsocket. Every connection slot runs on its own thread
+ * and issues requests one after the other the way the assignment clients do:
+ * connect, send a packet, half-close and read the replayed log until the
+ * server closes. So N slots keep N connections open at any time.
+ * Runs can be repeated over several slot counts and log sizes, the log is
+ * padded with large packets up to each size before the runs using it. Since
+ * every reply replays the whole log, this shows where history dominates.
+ * Results are printed as one JSON document.
+ */
+
+#define BENCH_MAX_LIST      32
+#define BENCH_MAX_SLOTS     4096
+#define BENCH_MIN_SIZE      48
+#define BENCH_FILL_CHUNK    0x100000
+#define BENCH_RECV_SIZE     0x10000
+
+enum bench_framing {
+    BENCH_LINE,     // the packet and its newline in one send
+    BENCH_SPLIT,    // the packet in two sends, split in the middle
+    BENCH_OPEN,     // no newline, the half-close ends the packet
+};
+
+static const char* const bench_framing_names[] = { "line", "split", "open" };
+
+typedef struct bench_cfg_s bench_cfg_t;
+struct bench_cfg_s {
+    struct addrinfo* addr;
+    const char* host;
+    const char* port;
+    long requests;
+    long size;
+    double rate;
+    enum bench_framing framing;
+    bool validate;
+};
+
+typedef struct bench_slot_s bench_slot_t;
+struct bench_slot_s {
+    const bench_cfg_t* cfg;
+    pthread_t thread;
+    int run;
+    int id;
+    uint64_t start;
+    uint64_t* lat;
+    long done;
+    long errors;
+    long invalid;
+    uint64_t sent;
+    uint64_t received;
+    char* pkt;
+    char* buf;
+    size_t cap;
+};
+
+typedef struct bench_result_s bench_result_t;
+struct bench_result_s {
+    long slots;
+    size_t history;
+    long done;
+    long errors;
+    long invalid;
+    uint64_t sent;
+    uint64_t received;
+    double seconds;
+    uint64_t* lat;
+};
+
+static uint64_t bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void bench_sleep_until(uint64_t t)
+{
+    struct timespec ts;
+    ts.tv_sec = t / 1000000000ull;
+    ts.tv_nsec = t % 1000000000ull;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+/* @return the size in @param s with an optional K, M or G suffix, -1 if invalid */
+static long bench_size(const char* s)
+{
+    char* e;
+    long v = strtol(s, &e, 10);
+    switch (*e)
+    {
+    case 'k':
+    case 'K':
+        v <<= 10;
+        e++;
+        break;
+    case 'm':
+    case 'M':
+        v <<= 20;
+        e++;
+        break;
+    case 'g':
+    case 'G':
+        v <<= 30;
+        e++;
+        break;
+    }
+    return (e == s || *e != '\0' || v < 0) ? -1 : v;
+}
+
+/* @return the number of comma separated sizes in @param s stored to @param v, -1 if invalid */
+static int bench_list(char* s, long* v)
+{
+    int n = 0;
+    for (char* tok = strtok(s, ","); tok; tok = strtok(NULL, ","))
+    {
+        if (n == BENCH_MAX_LIST || (v[n] = bench_size(tok)) < 0)
+        {
+            return -1;
+        }
+        n++;
+    }
+    return n;
+}
+
+static int bench_connect(const bench_cfg_t* cfg)
+{
+    const int enable = 1;
+    int fd = socket(cfg->addr->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(int));
+    if (connect(fd, cfg->addr->ai_addr, cfg->addr->ai_addrlen) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int bench_send(int fd, const char* p, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t sz = send(fd, p, len, MSG_NOSIGNAL);
+        if (sz < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        p += sz;
+        len -= sz;
+    }
+    return 0;
+}
+
+/**
+ * Send the @param len bytes at @param pkt as one request, read the reply into
+ * *@param buf, grown as needed.
+ * @return the reply length, -1 on error.
+ */
+static ssize_t bench_request(const bench_cfg_t* cfg, const char* pkt, size_t len, size_t split,
+                             char** buf, size_t* cap)
+{
+    ssize_t rc = -1;
+    size_t got = 0;
+    int fd = bench_connect(cfg);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    if (bench_send(fd, pkt, split) != 0 || bench_send(fd, pkt + split, len - split) != 0 ||
+        shutdown(fd, SHUT_WR) != 0)
+    {
+        goto out;
+    }
+    for (;;)
+    {
+        if (*cap - got < BENCH_RECV_SIZE)
+        {
+            size_t ncap = (*cap < BENCH_RECV_SIZE) ? 4 * BENCH_RECV_SIZE : 2 * *cap;
+            char* nbuf = realloc(*buf, ncap);
+            if (!nbuf)
+            {
+                goto out;
+            }
+            *buf = nbuf;
+            *cap = ncap;
+        }
+        ssize_t sz = recv(fd, *buf + got, *cap - got, 0);
+        if (sz < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            goto out;
+        }
+        if (sz == 0)
+        {
+            break;
+        }
+        got += sz;
+    }
+    rc = got;
+out:
+    close(fd);
+    return rc;
+}
+
+/* fill @param pkt with a packet of the configured size unique to run, slot and sequence */
+static size_t bench_packet(const bench_cfg_t* cfg, char* pkt, int run, int slot, long seq)
+{
+    size_t size = cfg->size;
+    int n = snprintf(pkt, size, "aesdbench %d run %d slot %d seq %ld ", (int)getpid(), run, slot, seq);
+    for (size_t i = n; i < size - 1; i++)
+    {
+        pkt[i] = 'a' + i % 26;
+    }
+    pkt[size - 1] = '\n';
+    return (cfg->framing == BENCH_OPEN) ? size - 1 : size;
+}
+
+static void* bench_slot_thread(void* arg)
+{
+    bench_slot_t* s = (bench_slot_t*)arg;
+    const bench_cfg_t* cfg = s->cfg;
+    uint64_t interval = (cfg->rate > 0) ? (uint64_t)(1e9 / cfg->rate) : 0;
+
+    for (long i = 0; i < cfg->requests; i++)
+    {
+        size_t len = bench_packet(cfg, s->pkt, s->run, s->id, i);
+        size_t split = (cfg->framing == BENCH_SPLIT) ? len / 2 : 0;
+        // an open loop measures from the scheduled send, so a stalled server
+        // is not hidden by the requests it kept us from sending
+        uint64_t t0;
+        if (interval)
+        {
+            t0 = s->start + i * interval;
+            bench_sleep_until(t0);
+        }
+        else
+        {
+            t0 = bench_now();
+        }
+        ssize_t got = bench_request(cfg, s->pkt, len, split, &s->buf, &s->cap);
+        uint64_t t1 = bench_now();
+        if (got < 0)
+        {
+            s->errors++;
+            continue;
+        }
+        s->lat[s->done++] = t1 - t0;
+        s->sent += len;
+        s->received += got;
+        if (cfg->validate && !memmem(s->buf, got, s->pkt, len))
+        {
+            s->invalid++;
+        }
+    }
+    return NULL;
+}
+
+/* @return the size of the replayed log, -1 if the server could not be reached */
+static ssize_t bench_history(const bench_cfg_t* cfg, char** buf, size_t* cap)
+{
+    return bench_request(cfg, "", 0, 0, buf, cap);
+}
+
+/* pad the log with large packets until it holds at least @param target bytes */
+static ssize_t bench_fill(const bench_cfg_t* cfg, size_t target, char** buf, size_t* cap)
+{
+    char* pkt = malloc(BENCH_FILL_CHUNK);
+    ssize_t size = bench_history(cfg, buf, cap);
+    if (!pkt)
+    {
+        return -1;
+    }
+    memset(pkt, '.', BENCH_FILL_CHUNK);
+    while (size >= 0 && (size_t)size < target)
+    {
+        size_t len = target - size;
+        len = (len < BENCH_FILL_CHUNK) ? len : BENCH_FILL_CHUNK;
+        len = (len < 2) ? 2 : len;
+        pkt[len - 1] = '\n';
+        ssize_t prev = size;
+        size = bench_request(cfg, pkt, len, 0, buf, cap);
+        pkt[len - 1] = '.';
+        if (size >= 0 && size <= prev)
+        {
+            // retention keeps the log below the target
+            fprintf(stderr, "Log stopped growing at %zd bytes\n", size);
+            break;
+        }
+    }
+    free(pkt);
+    return size;
+}
+
+static int bench_cmp(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static int bench_cmp_long(const void* a, const void* b)
+{
+    long x = *(const long*)a;
+    long y = *(const long*)b;
+    return (x > y) - (x < y);
+}
+
+static int bench_run(const bench_cfg_t* cfg, int run, long nslots, bench_result_t* res)
+{
+    int rc = -1;
+    long started = 0;
+    bench_slot_t* slots = calloc(nslots, sizeof(bench_slot_t));
+
+    memset(res, 0, sizeof(*res));
+    res->slots = nslots;
+    res->lat = calloc(nslots * cfg->requests, sizeof(uint64_t));
+    if (!slots || !res->lat)
+    {
+        fprintf(stderr, "Could not allocate memory for %ld connections\n", nslots);
+        goto out;
+    }
+
+    uint64_t start = bench_now();
+    for (; started < nslots; started++)
+    {
+        bench_slot_t* s = &slots[started];
+        s->cfg = cfg;
+        s->run = run;
+        s->id = started;
+        // spread the slots over one interval so an open loop does not send in bursts
+        s->start = start + ((cfg->rate > 0) ? (uint64_t)(1e9 / cfg->rate * started / nslots) : 0);
+        s->lat = res->lat + started * cfg->requests;
+        s->pkt = malloc(cfg->size);
+        if (!s->pkt || pthread_create(&s->thread, NULL, bench_slot_thread, s) != 0)
+        {
+            fprintf(stderr, "Could not start connection %ld\n", started);
+            free(s->pkt);
+            break;
+        }
+    }
+    for (long i = 0; i < started; i++)
+    {
+        bench_slot_t* s = &slots[i];
+        pthread_join(s->thread, NULL);
+        // pack the latencies of all slots at the front
+        memmove(res->lat + res->done, s->lat, s->done * sizeof(uint64_t));
+        res->done += s->done;
+        res->errors += s->errors;
+        res->invalid += s->invalid;
+        res->sent += s->sent;
+        res->received += s->received;
+        free(s->pkt);
+        free(s->buf);
+    }
+    res->seconds = (bench_now() - start) / 1e9;
+    qsort(res->lat, res->done, sizeof(uint64_t), bench_cmp);
+    rc = (started == nslots) ? 0 : -1;
+out:
+    free(slots);
+    return rc;
+}
+
+static double bench_quantile(const bench_result_t* res, double q)
+{
+    if (res->done == 0)
+    {
+        return 0;
+    }
+    size_t i = (size_t)(q * res->done);
+    i = (i < (size_t)res->done) ? i : (size_t)res->done - 1;
+    return res->lat[i] / 1e3;
+}
+
+static void bench_print(const bench_result_t* res, bool first)
+{
+    double mean = 0;
+    for (long i = 0; i < res->done; i++)
+    {
+        mean += res->lat[i];
+    }
+    mean = res->done ? mean / res->done / 1e3 : 0;
+    printf("%s    {\"connections\": %ld, \"history_bytes\": %zu, \"requests\": %ld, "
+           "\"errors\": %ld, \"invalid\": %ld, \"seconds\": %.3f,\n",
+           first ? "" : ",\n", res->slots, res->history, res->done, res->errors, res->invalid, res->seconds);
+    printf("     \"requests_per_sec\": %.1f, \"sent_bytes_per_sec\": %.0f, \"received_bytes_per_sec\": %.0f,\n",
+           res->done / res->seconds, res->sent / res->seconds, res->received / res->seconds);
+    printf("     \"latency_us\": {\"mean\": %.1f, \"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}}",
+           mean, bench_quantile(res, 0.5), bench_quantile(res, 0.99), bench_quantile(res, 0.999),
+           res->done ? res->lat[res->done - 1] / 1e3 : 0);
+}
+
+static void bench_usage(const char* prog)
+{
+    fprintf(stderr, "Usage: %s [-a host] [-P port] [-c connections,...] [-H history bytes,...] "
+            "[-n requests per connection] [-s packet size] [-r requests per second per connection] "
+            "[-f line|split|open] [-V]\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char** argv)
+{
+    bench_cfg_t cfg;
+    long conns[BENCH_MAX_LIST] = { 1 };
+    long hist[BENCH_MAX_LIST] = { 0 };
+    int nconns = 1;
+    int nhist = 1;
+    int opt;
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.host = "localhost";
+    cfg.port = "9000";
+    cfg.requests = 100;
+    cfg.size = 128;
+    cfg.framing = BENCH_LINE;
+
+    while ((opt = getopt(argc, argv, "a:P:c:H:n:s:r:f:V")) != -1)
+    {
+        switch (opt)
+        {
+        case 'a':
+            cfg.host = optarg;
+            break;
+        case 'P':
+            cfg.port = optarg;
+            break;
+        case 'c':
+            if ((nconns = bench_list(optarg, conns)) <= 0)
+            {
+                bench_usage(argv[0]);
+            }
+            break;
+        case 'H':
+            if ((nhist = bench_list(optarg, hist)) <= 0)
+            {
+                bench_usage(argv[0]);
+            }
+            break;
+        case 'n':
+            cfg.requests = strtol(optarg, NULL, 10);
+            break;
+        case 's':
+            cfg.size = bench_size(optarg);
+            break;
+        case 'r':
+            cfg.rate = strtod(optarg, NULL);
+            break;
+        case 'f':
+            if (strcmp(optarg, "line") == 0)
+            {
+                cfg.framing = BENCH_LINE;
+            }
+            else if (strcmp(optarg, "split") == 0)
+            {
+                cfg.framing = BENCH_SPLIT;
+            }
+            else if (strcmp(optarg, "open") == 0)
+            {
+                cfg.framing = BENCH_OPEN;
+            }
+            else
+            {
+                bench_usage(argv[0]);
+            }
+            break;
+        case 'V':
+            cfg.validate = true;
+            break;
+        default:
+            bench_usage(argv[0]);
+        }
+    }
+    if (cfg.requests < 1 || cfg.size < BENCH_MIN_SIZE)
+    {
+        fprintf(stderr, "Need at least 1 request of %d bytes\n", BENCH_MIN_SIZE);
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < nconns; i++)
+    {
+        if (conns[i] < 1 || conns[i] > BENCH_MAX_SLOTS)
+        {
+            fprintf(stderr, "Connections must be between 1 and %d\n", BENCH_MAX_SLOTS);
+            exit(EXIT_FAILURE);
+        }
+    }
+    // the log only grows, so pad it to the smallest size first
+    qsort(hist, nhist, sizeof(long), bench_cmp_long);
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int gai = getaddrinfo(cfg.host, cfg.port, &hints, &cfg.addr);
+    if (gai != 0)
+    {
+        fprintf(stderr, "Could not resolve %s:%s: %s\n", cfg.host, cfg.port, gai_strerror(gai));
+        exit(EXIT_FAILURE);
+    }
+
+    char* buf = NULL;
+    size_t cap = 0;
+    int status = EXIT_SUCCESS;
+    int run = 0;
+
+    printf("{\"host\": \"%s\", \"port\": \"%s\", \"packet_size\": %ld, \"framing\": \"%s\", "
+           "\"requests_per_connection\": %ld, \"rate_per_connection\": %.1f, \"validate\": %s,\n"
+           " \"runs\": [\n",
+           cfg.host, cfg.port, cfg.size, bench_framing_names[cfg.framing], cfg.requests,
+           cfg.rate, cfg.validate ? "true" : "false");
+    for (int h = 0; h < nhist && status == EXIT_SUCCESS; h++)
+    {
+        for (int c = 0; c < nconns; c++)
+        {
+            bench_result_t res;
+            ssize_t size = (c == 0) ? bench_fill(&cfg, hist[h], &buf, &cap) : bench_history(&cfg, &buf, &cap);
+            if (size < 0)
+            {
+                fprintf(stderr, "Could not reach %s:%s: %s\n", cfg.host, cfg.port, strerror(errno));
+                status = EXIT_FAILURE;
+                break;
+            }
+            if (bench_run(&cfg, run++, conns[c], &res) != 0)
+            {
+                status = EXIT_FAILURE;
+            }
+            res.history = size;
+            bench_print(&res, run == 1);
+            free(res.lat);
+            if (status != EXIT_SUCCESS)
+            {
+                break;
+            }
+        }
+    }
+    printf("\n ]}\n");
+    free(buf);
+    freeaddrinfo(cfg.addr);
+    return status;
+}
@@ -9,8 +9,12 @@ case "$1" in
         echo "Stopping aesdsocket"
         start-stop-daemon -K -n aesdsocket
         ;;
+    reload)
+        echo "Reloading aesdsocket configuration"
+        start-stop-daemon -K -s HUP -n aesdsocket
+        ;;
     *)
-        echo "Usage: $0 {start|stop}"
+        echo "Usage: $0 {start|stop|reload}"
     exit 1
 esac
 
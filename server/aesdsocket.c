@@ -1,6 +1,5 @@
 #include <errno.h>
 #include <malloc.h>
-#include <netdb.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdbool.h>
@@ -10,425 +9,160 @@
 #include <syslog.h>
 #include <time.h>
 #include <unistd.h>
-#include <arpa/inet.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/wait.h>
-#include "queue.h"
-
-static volatile bool run = true;
-static void sig_handler(int signum);
-static void* receive_send_thread(void* arg);
-static void timer_thread (union sigval sigval);
+#include "aesdsocket.h"
+#include "channels.h"
+#include "config.h"
+#include "ev_server.h"
+#include "listener.h"
+#include "logger.h"
+#include "framer.h"
+#include "metrics.h"
+#include "outq.h"
+#include "packet_store.h"
+#include "pool_server.h"
+#include "protocol.h"
+#include "signals.h"
+#include "slab.h"
+#include "ticker.h"
+#include "uring_server.h"
+
+volatile bool run = true;
 
 const char filename[] = "/var/tmp/aesdsocketdata";
 
-typedef struct slist_data_s slist_data_t;
-struct slist_data_s {
-    int fd;
-    pthread_t thread;
-    pthread_mutex_t* mutex;
-    bool complete;
-    SLIST_ENTRY(slist_data_s) entries;
-};
-SLIST_HEAD(slisthead, slist_data_s) head;
-
 
 int main (int argc, char **argv) 
 {
-    char dst[INET_ADDRSTRLEN];
-    bool dm = false;
+    config_t cfg;
+    lsn_set_t lsn = { NULL, 0 };
+    sigs_t sigs = { -1, -1, 0, 0, NULL };
+    chan_set_t chans;
+    ticker_t tick;
     int rc;
-    
-    if ((argc == 2) && (strcmp(argv[1], "-d") == 0))
-    {
-        syslog(LOG_DEBUG, "Will run aesdsocket as daemon");
-        dm = true;
-    }
-    int sfd = -1;
-    syslog(LOG_DEBUG, "Running aesdsocket");
-    openlog(NULL, 0, LOG_USER);
 
-    int status;
-    sfd = socket(PF_INET, SOCK_STREAM, 0);
-    if (sfd == -1)
-    {
-        syslog(LOG_ERR, "Error creating socket: %s", strerror(errno));
-        goto error;
-    }
-    const int enable = 1;
-    if (setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) < 0)
+    if (config_init(&cfg, argc, argv) != 0)
     {
-        syslog(LOG_ERR, "setsockopt(SO_REUSEADDR) failed");
-        goto error;
-    }
-    struct addrinfo hints;
-    struct addrinfo* res = NULL;
-    memset(&hints, 0, sizeof(struct addrinfo));
-    hints.ai_flags = AI_PASSIVE;
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
-
-    if ((status = getaddrinfo(NULL, "9000", &hints, &res)) != 0)
-    {
-        syslog(LOG_ERR, "Error getting addr info: %s", gai_strerror(status));
-        goto error;
+        exit(EXIT_FAILURE);
     }
+    config_apply(&cfg);
+    LOGGER(LOG_DEBUG, "Running aesdsocket");
+    openlog(NULL, 0, LOG_USER);
 
-    struct sockaddr_in* sin = (struct sockaddr_in*)res->ai_addr;
-    syslog (LOG_DEBUG, "sockaddr: fam:%d, addr:%s:%d", 
-        sin->sin_family, 
-        inet_ntop(AF_INET, (struct sockaddr_in *)res->ai_addr, dst, sizeof(dst)),
-        ntohs(sin->sin_port)
-        );
-
-    if ((status = bind(sfd, res->ai_addr, sizeof(struct sockaddr))) != 0)
+    if (lsn_open(&lsn, cfg.port, cfg.listeners) != 0)
     {
-        syslog(LOG_ERR, "Error binding socket: %s", strerror(errno));
-        freeaddrinfo(res);
         goto error;
     }
-    freeaddrinfo(res);
-
-    SLIST_INIT(&head);
 
-    pid_t pid = (dm) ? fork() : 0;
+    pid_t pid = (cfg.daemon) ? fork() : 0;
 
-    syslog(LOG_INFO, "pid: %d, sfd: %d", pid, sfd);
+    LOGGER(LOG_INFO, "pid: %d, listeners: %d", pid, lsn.count);
     if (pid == 0)
     {
-        //child or non-daemon process
-        slist_data_t* datap = NULL;
-        slist_data_t* tempp = NULL;
-        struct sigaction act;
-        memset(&act, 0, sizeof(struct sigaction));
-        act.sa_handler = sig_handler;
-        if (sigaction(SIGTERM, &act, NULL) != 0)
+        //child or non-daemon process, threads do not survive the fork
+        // signals are blocked before any thread starts, so only the signalfd sees them
+        if (sigs_init(&sigs, cfg.drain) != 0)
         {
-            syslog(LOG_ERR, "Failed registering for SIGTERM: %s", strerror(errno));
             goto error;
         }
-        if (sigaction(SIGINT, &act, NULL) != 0)
+        if (logger_start() != 0)
         {
-            syslog(LOG_ERR, "Failed registering for SIGINT: %s", strerror(errno));
             goto error;
         }
-
-        pthread_mutex_t mutex;
-        if ((rc = pthread_mutex_init(&mutex, NULL)) != 0)
+        if (cfg.metrics_port > 0 && metrics_start(cfg.metrics_port) != 0)
         {
-            syslog(LOG_ERR, "Failed to initialize mutex: %d", rc);
             goto error;
         }
 
-        struct sigevent sev;
-        timer_t timerid;
-        memset(&sev, 0, sizeof(struct sigevent));
-        sev.sigev_notify = SIGEV_THREAD;
-        sev.sigev_value.sival_ptr = &mutex;
-        sev.sigev_notify_function = timer_thread;
-        if (timer_create(CLOCK_MONOTONIC, &sev, &timerid) != 0)
-        {
-            syslog(LOG_ERR, "Failed to create timer: %d", errno);
-            goto error;
-        }
-        struct itimerspec its;
-        its.it_interval.tv_sec = 10;
-        its.it_interval.tv_nsec = 0;
-        its.it_value.tv_sec = 10;
-        its.it_value.tv_nsec = 0;
-        if (timer_settime(timerid, TIMER_ABSTIME, &its, NULL) != 0)
+        if (chan_init(&chans, (cfg.sync == PSTORE_SYNC_MEMORY) ? NULL : cfg.path, cfg.ring_pkts, cfg.ring_bytes) != 0)
         {
-            syslog(LOG_ERR, "Failed to set timer: %d", errno);
-            timer_delete(timerid);
             goto error;
         }
+        chan_durability(&chans, cfg.sync, cfg.sync_ms);
+        chan_retain(&chans, cfg.retain_bytes, cfg.retain_pkts, cfg.retain_age);
+        proto_channels(&chans);
 
-        while (run)
-        {      
-            int afd;
-            if ((status = listen(sfd, 10)) != 0)
-            {
-                syslog(LOG_ERR, "Error listening for connection: %s", strerror(errno));
-                timer_delete(timerid);
-                goto error;
-            }
-            else
-            {
-                struct sockaddr addr;
-                socklen_t addrlen = sizeof(struct sockaddr);
-                if ((afd = accept(sfd, &addr, &addrlen)) <= 0)
-                {
-                    syslog(LOG_ERR, "Error accepting connection: %s", strerror(errno));
-                    timer_delete(timerid);
-                    goto error;
-                }
-                else
-                {
-                    sin = (struct sockaddr_in*)&addr;
-                    syslog(LOG_INFO, "Accepted connection from %s:%d", inet_ntop(AF_INET, (struct sockaddr_in *)&addr, dst, sizeof(dst)), ntohs(sin->sin_port));
-
-                    datap = malloc(sizeof(slist_data_t));
-                    if (!datap)
-                    {
-                        syslog(LOG_ERR, "Could not allocate memory for list entry");
-                        timer_delete(timerid);
-                        shutdown(afd, SHUT_RDWR);
-                        close(afd);
-                        goto error;
-                    }
-                    datap->fd = afd;
-                    datap->mutex = &mutex;
-                    datap->complete = false;
-                    rc = pthread_create(&datap->thread, 
-                                            NULL,
-                                            receive_send_thread,
-                                            datap);
-                    if (rc != 0)
-                    {
-                        syslog(LOG_ERR, "Could not create thread");
-                        free(datap);
-                        timer_delete(timerid);
-                        shutdown(afd, SHUT_RDWR);
-                        close(afd);
-                        goto error;
-                    }
-                    SLIST_INSERT_HEAD(&head, datap, entries);
-
-                    SLIST_FOREACH_SAFE(datap, &head, entries, tempp)
-                    {
-                        if (datap->complete)
-                        {
-                            pthread_join(datap->thread, NULL);
-                            shutdown(datap->fd, SHUT_RDWR);
-                            close(datap->fd);
-                            syslog(LOG_INFO, "Closed connection");
-                            SLIST_REMOVE(&head, datap, slist_data_s, entries);
-                            free(datap);
-                        }
-                    }
-                }
-            }
-        }
-        SLIST_FOREACH_SAFE(datap, &head, entries, tempp)
+        // timestamps go to the default channel
+        if (ticker_init(&tick, chans.stores[0], cfg.tick_sec) != 0)
         {
-            pthread_join(datap->thread, NULL);
-            shutdown(datap->fd, SHUT_RDWR);
-            close(datap->fd);
-            syslog(LOG_INFO, "Closed connection");
-            SLIST_REMOVE(&head, datap, slist_data_s, entries);
-            free(datap);
+            goto error_chans;
         }
-        timer_delete(timerid);
-        shutdown(sfd, SHUT_RDWR);
-        close(sfd);
-        remove(filename);
-        closelog();
-        exit(EXIT_SUCCESS);
-    }
-    else if (pid > 0)
-    {
-        exit(EXIT_SUCCESS);
-    }
-    else
-    {
-        exit(EXIT_FAILURE);
-    }
-
-error:
-    remove(filename);
-    if (sfd != -1)
-    {
-        shutdown(sfd, SHUT_RDWR);
-        close(sfd);
-    }
-    closelog();
-    status = EXIT_FAILURE;
-    return -1;
-}
-
-static void* receive_send_thread(void* arg)
-{
-    slist_data_t* datap = (slist_data_t*)arg;
-    FILE* file = NULL;
-    char* buf = NULL;
 
-    syslog(LOG_DEBUG, "Opening writefile");
-    file = fopen(filename, "a+");
-    if (!file)
-    {
-        syslog(LOG_ERR, "Could not open write file: %s", filename);
-        goto error;
-    }
-
-    
-    int sz, rc;
-    buf = malloc(0x4000);
-    while ((sz = recv(datap->fd, buf, 0x4000, 0)) > 0)
-    {
-        if (sz < 0) 
-        {
-            syslog(LOG_ERR, "Error while waiting for receive data: %s", strerror(errno));
-            goto error;
-        }
+        config_watch(&cfg, &chans, &tick, &sigs);
+        sigs.reload = config_reload;
 
-        syslog(LOG_DEBUG, "Read %d characters: %s from socket", sz, buf);
-        rc = pthread_mutex_lock(datap->mutex);
-        if (rc != 0)
+        if (lsn_listen(&lsn, cfg.backlog) != 0)
         {
-            syslog(LOG_ERR, "Error locking mutex: %d", rc);
+            goto error_tick;
         }
-        else
+        // the engine running, cfg keeps what was configured so reloads compare like with like
+        enum config_engine engine = cfg.engine;
+        long workers = cfg.workers;
+        if (engine == CONFIG_ENGINE_URING)
         {
-            if (fwrite(buf, 1, sz, file) < 1)
+            rc = uring_server_run(&lsn, &chans, &tick, &sigs);
+            if (rc == URING_UNSUPPORTED)
             {
-                syslog(LOG_ERR, "Could not write %s to file", buf);
-                pthread_mutex_unlock(datap->mutex);
-                goto error;
-            }
-            fflush(file);
-            rc = pthread_mutex_unlock(datap->mutex);
-            if (rc != 0)
-            {
-                syslog(LOG_ERR, "Error unlocking mutex: %d", rc);
+                LOGGER(LOG_INFO, "Falling back to thread pool engine");
+                engine = CONFIG_ENGINE_THREAD;
+                if (cfg.workers_auto)
+                {
+                    workers = POOL_DEFAULT_WORKERS;
+                }
             }
-            if (buf[sz-1] == '\n')
+            else if (rc != 0)
             {
-                break;
+                goto error_tick;
             }
         }
-    }
-    free(buf);
-    buf = NULL;
-
-    if (fclose(file) != 0)
-    {
-        syslog(LOG_ERR, "Could not close write file: %s", filename);
-        file = NULL;
-        goto error;
-    }
-
-    syslog(LOG_DEBUG, "Opening readfile");
-    file = fopen(filename, "rb");
-    if (!file)
-    {
-        syslog(LOG_ERR, "Could not open read file: %s", filename);
-        goto error;
-    }
-
-    size_t j;
-    while (!feof(file))
-    {
-        int tsz;
-        j = 0;
-        sz = getline(&buf, &j, file);
-        if (sz < 0)
+        if (engine == CONFIG_ENGINE_EPOLL)
         {
-            syslog(LOG_DEBUG, "Could not get another line from file %s, error: %s", filename, strerror(errno));
+            if (ev_server_run(&lsn, &chans, &tick, &sigs, workers) != 0)
+            {
+                goto error_tick;
+            }
         }
-        else
+        if (engine == CONFIG_ENGINE_THREAD)
         {
-            syslog(LOG_DEBUG, "Writing %d characters: %s to socket", sz, buf);
-            tsz = send(datap->fd, buf, sz, 0);
-            if (tsz != sz)
+            if (pool_server_run(&lsn, &chans, &tick, &sigs, workers, cfg.depth, cfg.overload) != 0)
             {
-                syslog(LOG_ERR, "Buffer length mismatch #3");
-                goto error;
+                goto error_tick;
             }
-            syslog(LOG_DEBUG, "Done writing %d characters: %s to socket", sz, buf);
         }
-        free(buf);
-        buf = NULL;
-    }
-    syslog(LOG_INFO, "Found EOF in %s", filename);
-    if (fclose(file) != 0)
-    {
-        syslog(LOG_ERR, "Could not close read file: %s", filename);
-    }
-    file = NULL;
-error:
-    if (buf)
-    {
-        free(buf);
-    }
-    if (file)
-    {
-        fclose(file);
-    }
-    datap->complete = true;
-    return NULL;
-}
-
-static void timer_thread(union sigval sigval)
-{
-    pthread_mutex_t* mutex = (pthread_mutex_t*)sigval.sival_ptr;
-    char buf[200];
-    FILE* file = NULL;
-
-    syslog(LOG_DEBUG, "Opening writefile");
-    file = fopen(filename, "a+");
-    if (!file)
-    {
-        syslog(LOG_ERR, "Could not open write file: %s", filename);
-        goto error;
-    }
-
-    sprintf(buf, "timestamp:");
-    time_t t;
-    struct tm* tmp;
-
-    t = time(NULL);
-    tmp = localtime(&t);
-    if(!tmp)
-    {
-        syslog(LOG_ERR, "Error getting time");
-        goto error;
-    }
-    if (strftime(&buf[10], sizeof(buf) - 10, "%a, %d %b %Y %T %z\n", tmp) == 0) 
-    {
-        syslog(LOG_ERR, "Error strftime");
-        goto error;
+        // listeners first, so a restarted instance can take over the port at once
+        lsn_close(&lsn);
+        LOGGER(LOG_INFO, "Connections drained, exiting");
+        chan_destroy(&chans, true);
+        ticker_destroy(&tick);
+        slab_log_stats();
+        sigs_destroy(&sigs);
+        metrics_stop();
+        logger_stop();
+        closelog();
+        exit(EXIT_SUCCESS);
     }
-        
-    size_t sz = strlen(buf);
-    syslog(LOG_DEBUG, "Writing %ld characters: %s to file", sz, buf);
-    int rc = pthread_mutex_lock(mutex);
-    if (rc != 0)
+    else if (pid > 0)
     {
-        syslog(LOG_ERR, "Error locking mutex: %d", rc);
-        goto error;
+        exit(EXIT_SUCCESS);
     }
     else
     {
-        if (fwrite(buf, 1, strlen(buf), file) < 1)
-        {
-            syslog(LOG_ERR, "Could not write %s to file", buf);
-            pthread_mutex_unlock(mutex);
-            goto error;
-        }
-        fflush(file);
-        rc = pthread_mutex_unlock(mutex);
-        if (rc != 0)
-        {
-            syslog(LOG_ERR, "Error unlocking mutex: %d", rc);
-        }
+        exit(EXIT_FAILURE);
     }
 
-    if (fclose(file) != 0)
-    {
-        syslog(LOG_ERR, "Could not close read file: %s", filename);
-    }
-    file = NULL;
+error_tick:
+    ticker_destroy(&tick);
+error_chans:
+    // joins the writer and reaper threads before their files go
+    chan_destroy(&chans, true);
 error:
-    if (file)
-    {
-        fclose(file);
-    }
-}
-
-
-static void sig_handler(int signum)
-{
-    syslog(LOG_INFO, "Caught signal, exiting");
-    run = false;
+    pstore_remove(cfg.path);
+    lsn_close(&lsn);
+    sigs_destroy(&sigs);
+    metrics_stop();
+    logger_stop();
+    closelog();
+    return -1;
 }
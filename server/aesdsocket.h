@@ -0,0 +1,13 @@
+#ifndef AESDSOCKET_H
+#define AESDSOCKET_H
+
+#include <stdbool.h>
+
+/**
+ * Shared state of the aesdsocket server used by the different connection
+ * engines.
+ */
+extern volatile bool run;
+extern const char filename[];
+
+#endif
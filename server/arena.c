@@ -0,0 +1,76 @@
+#include <stdalign.h>
+#include <stddef.h>
+#include <string.h>
+#include "arena.h"
+#include "slab.h"
+
+#define ARENA_ALIGN(n)  (((n) + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1))
+
+/* heads every block, linking it to the block allocated before */
+typedef struct arena_blk_s arena_blk_t;
+struct arena_blk_s {
+    arena_blk_t* prev;
+    size_t cap;
+};
+
+struct arena_s {
+    arena_blk_t* blk;
+    size_t used;
+};
+
+static arena_blk_t* arena_block(arena_blk_t* prev, size_t size)
+{
+    size_t cap;
+    arena_blk_t* blk = slab_get(size, &cap);
+    if (blk)
+    {
+        blk->prev = prev;
+        blk->cap = cap;
+    }
+    return blk;
+}
+
+arena_t* arena_create(void)
+{
+    arena_blk_t* blk = arena_block(NULL, ARENA_BLOCK);
+    if (!blk)
+    {
+        return NULL;
+    }
+    arena_t* a = (arena_t*)((char*)blk + ARENA_ALIGN(sizeof(arena_blk_t)));
+    a->blk = blk;
+    a->used = ARENA_ALIGN(sizeof(arena_blk_t)) + ARENA_ALIGN(sizeof(arena_t));
+    return a;
+}
+
+void* arena_alloc(arena_t* a, size_t size)
+{
+    size = ARENA_ALIGN(size);
+    if (a->blk->cap - a->used < size)
+    {
+        size_t hdr = ARENA_ALIGN(sizeof(arena_blk_t));
+        arena_blk_t* blk = arena_block(a->blk, (size + hdr > ARENA_BLOCK) ? size + hdr : ARENA_BLOCK);
+        if (!blk)
+        {
+            return NULL;
+        }
+        a->blk = blk;
+        a->used = hdr;
+    }
+    void* p = (char*)a->blk + a->used;
+    a->used += size;
+    memset(p, 0, size);
+    return p;
+}
+
+void arena_destroy(arena_t* a)
+{
+    arena_blk_t* blk = a->blk;
+    while (blk)
+    {
+        // the arena is in the first block, so it goes last
+        arena_blk_t* prev = blk->prev;
+        slab_put(blk, blk->cap);
+        blk = prev;
+    }
+}
@@ -0,0 +1,32 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/**
+ * Bump allocator for everything that lives exactly as long as one connection.
+ * Its blocks come from the slab pool and all go back at once when the arena is
+ * destroyed, so opening and closing connections does not reach malloc once
+ * the pool is warm. The arena itself lives in its first block.
+ */
+typedef struct arena_s arena_t;
+
+#define ARENA_BLOCK     0x1000
+
+/**
+* @return a new arena, NULL if out of memory.
+*/
+arena_t* arena_create(void);
+
+/**
+* @return @param size zeroed bytes from @param a, NULL if out of memory.
+*/
+void* arena_alloc(arena_t* a, size_t size);
+
+/**
+* Give all memory of @param a back to the slab pool, including anything
+* allocated from it.
+*/
+void arena_destroy(arena_t* a);
+
+#endif
@@ -0,0 +1,216 @@
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include "channels.h"
+#include "logger.h"
+
+static bool chan_valid(const char* name, size_t len)
+{
+    if (len > CHAN_NAME_MAX)
+    {
+        return false;
+    }
+    for (size_t i = 0; i < len; i++)
+    {
+        char c = name[i];
+        if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+              (c >= '0' && c <= '9') || c == '_' || c == '-'))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* backing file path of the channel at @param i, NULL in memory */
+static const char* chan_path(chan_set_t* cs, int i, char* buf, size_t len)
+{
+    if (!cs->path)
+    {
+        return NULL;
+    }
+    if (i == 0)
+    {
+        return cs->path;
+    }
+    snprintf(buf, len, "%s-%s", cs->path, cs->names[i]);
+    return buf;
+}
+
+/* called with the lock held */
+static pstore_t* chan_create(chan_set_t* cs, const char* name, size_t len)
+{
+    char path[PATH_MAX];
+    int i = cs->count;
+
+    pstore_t* ps = malloc(sizeof(pstore_t));
+    if (!ps)
+    {
+        LOGGER(LOG_ERR, "Could not allocate channel %.*s", (int)len, name);
+        return NULL;
+    }
+    memcpy(cs->names[i], name, len);
+    cs->names[i][len] = '\0';
+    int rc = cs->ring_pkts ? pstore_init_ring(ps, cs->ring_pkts, cs->ring_bytes)
+                           : pstore_init(ps, chan_path(cs, i, path, sizeof(path)));
+    if (rc != 0)
+    {
+        free(ps);
+        return NULL;
+    }
+    pstore_durability(ps, cs->sync, cs->sync_ms);
+    pstore_retain(ps, cs->retain_bytes, cs->retain_pkts, cs->retain_age);
+    if (cs->interrupted)
+    {
+        pstore_interrupt(ps);
+    }
+    cs->stores[i] = ps;
+    cs->count++;
+    if (i > 0)
+    {
+        LOGGER(LOG_INFO, "Opened channel %s", cs->names[i]);
+    }
+    return ps;
+}
+
+int chan_init(chan_set_t* cs, const char* path, size_t ring_pkts, size_t ring_bytes)
+{
+    int rc;
+
+    memset(cs, 0, sizeof(chan_set_t));
+    cs->path = ring_pkts ? NULL : path;
+    cs->ring_pkts = ring_pkts;
+    cs->ring_bytes = ring_bytes;
+    cs->sync = cs->path ? PSTORE_SYNC_BUFFERED : PSTORE_SYNC_MEMORY;
+    if ((rc = pthread_mutex_init(&cs->lock, NULL)) != 0)
+    {
+        LOGGER(LOG_ERR, "Failed to initialize channel mutex: %d", rc);
+        return -1;
+    }
+    if (!chan_create(cs, "", 0))
+    {
+        pthread_mutex_destroy(&cs->lock);
+        return -1;
+    }
+    return 0;
+}
+
+void chan_destroy(chan_set_t* cs, bool remove)
+{
+    char path[PATH_MAX];
+
+    for (int i = 0; i < cs->count; i++)
+    {
+        pstore_destroy(cs->stores[i]);
+        free(cs->stores[i]);
+        if (remove && cs->path)
+        {
+            pstore_remove(chan_path(cs, i, path, sizeof(path)));
+        }
+    }
+    cs->count = 0;
+    pthread_mutex_destroy(&cs->lock);
+}
+
+void chan_retain(chan_set_t* cs, size_t bytes, size_t packets, time_t age)
+{
+    pthread_mutex_lock(&cs->lock);
+    cs->retain_bytes = bytes;
+    cs->retain_pkts = packets;
+    cs->retain_age = age;
+    for (int i = 0; i < cs->count; i++)
+    {
+        pstore_retain(cs->stores[i], bytes, packets, age);
+    }
+    pthread_mutex_unlock(&cs->lock);
+}
+
+void chan_durability(chan_set_t* cs, enum pstore_sync mode, int interval_ms)
+{
+    pthread_mutex_lock(&cs->lock);
+    cs->sync = mode;
+    cs->sync_ms = interval_ms;
+    for (int i = 0; i < cs->count; i++)
+    {
+        pstore_durability(cs->stores[i], mode, interval_ms);
+    }
+    pthread_mutex_unlock(&cs->lock);
+}
+
+pstore_t* chan_open(chan_set_t* cs, const char* name, size_t len)
+{
+    pstore_t* ps = NULL;
+
+    if (!chan_valid(name, len))
+    {
+        LOGGER(LOG_INFO, "Invalid channel name %.*s", (int)len, name);
+        return NULL;
+    }
+    pthread_mutex_lock(&cs->lock);
+    for (int i = 0; i < cs->count; i++)
+    {
+        if (strlen(cs->names[i]) == len && memcmp(cs->names[i], name, len) == 0)
+        {
+            ps = cs->stores[i];
+            break;
+        }
+    }
+    if (!ps)
+    {
+        if (cs->count < CHAN_MAX)
+        {
+            ps = chan_create(cs, name, len);
+        }
+        else
+        {
+            LOGGER(LOG_INFO, "No room for channel %.*s, %d open", (int)len, name, cs->count);
+        }
+    }
+    pthread_mutex_unlock(&cs->lock);
+    return ps;
+}
+
+int chan_index(chan_set_t* cs, pstore_t* store)
+{
+    int index = 0;
+
+    pthread_mutex_lock(&cs->lock);
+    for (int i = 0; i < cs->count; i++)
+    {
+        if (cs->stores[i] == store)
+        {
+            index = i;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&cs->lock);
+    return index;
+}
+
+void chan_barrier(chan_set_t* cs)
+{
+    pstore_t* stores[CHAN_MAX];
+
+    // the appends wait, so not under the lock a channel being opened needs
+    pthread_mutex_lock(&cs->lock);
+    int n = cs->count;
+    memcpy(stores, cs->stores, n * sizeof(pstore_t*));
+    pthread_mutex_unlock(&cs->lock);
+    for (int i = 0; i < n; i++)
+    {
+        pstore_append(stores[i], "", 0);
+    }
+}
+
+void chan_interrupt(chan_set_t* cs)
+{
+    pthread_mutex_lock(&cs->lock);
+    cs->interrupted = true;
+    for (int i = 0; i < cs->count; i++)
+    {
+        pstore_interrupt(cs->stores[i]);
+    }
+    pthread_mutex_unlock(&cs->lock);
+}
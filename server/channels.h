@@ -0,0 +1,86 @@
+#ifndef CHANNELS_H
+#define CHANNELS_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+#include "packet_store.h"
+
+#define CHAN_MAX        64
+#define CHAN_NAME_MAX   32
+
+/**
+ * Named channels, each a packet store of its own with its own log, index,
+ * lock and writer thread, so appends to different channels never contend and
+ * a replay only covers the history of its channel. Channel 0 is the default
+ * one, named "", backed by the path given to chan_init. A named channel is
+ * created the first time a client selects it and backed by "<path>-<name>",
+ * or by a ring of its own that is allocated in full right then.
+ * Stores are never freed before chan_destroy, so a pointer to one stays valid.
+ */
+typedef struct chan_set_s chan_set_t;
+struct chan_set_s {
+    pthread_mutex_t lock;
+    pstore_t* stores[CHAN_MAX];
+    char names[CHAN_MAX][CHAN_NAME_MAX + 1];
+    int count;
+    const char* path;
+    size_t ring_pkts;
+    size_t ring_bytes;
+    size_t retain_bytes;
+    size_t retain_pkts;
+    time_t retain_age;
+    enum pstore_sync sync;
+    int sync_ms;
+    bool interrupted;
+};
+
+/**
+* Initialize @param cs with the default channel, backed by the file at
+* @param path if it is not NULL, else by memory like every other channel.
+* With @param ring_pkts above 0 every channel is instead a ring keeping the
+* last ring_pkts packets in @param ring_bytes bytes, see pstore_init_ring.
+* @return 0 on success, -1 on error.
+*/
+int chan_init(chan_set_t* cs, const char* path, size_t ring_pkts, size_t ring_bytes);
+
+/**
+* Release every channel, and remove their backing files if @param remove is set.
+*/
+void chan_destroy(chan_set_t* cs, bool remove);
+
+/**
+* Apply pstore_retain to every channel, present and future.
+*/
+void chan_retain(chan_set_t* cs, size_t bytes, size_t packets, time_t age);
+
+/**
+* Apply pstore_durability to every channel, present and future.
+*/
+void chan_durability(chan_set_t* cs, enum pstore_sync mode, int interval_ms);
+
+/**
+* Find the channel named by the @param len bytes at @param name, creating it
+* if it does not exist yet. An empty name is the default channel.
+* @return the store of the channel, NULL if the name is invalid or no more
+* channels can be created.
+*/
+pstore_t* chan_open(chan_set_t* cs, const char* name, size_t len);
+
+/**
+* @return the index of the channel of @param store, from 0 to CHAN_MAX - 1.
+*/
+int chan_index(chan_set_t* cs, pstore_t* store);
+
+/**
+* Wait until every append submitted to any channel so far has completed.
+*/
+void chan_barrier(chan_set_t* cs);
+
+/**
+* Apply pstore_interrupt to every channel, for shutting down.
+*/
+void chan_interrupt(chan_set_t* cs);
+
+#endif
@@ -0,0 +1,600 @@
+#include <ctype.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include "aesdsocket.h"
+#include "config.h"
+#include "framer.h"
+#include "listener.h"
+#include "logger.h"
+#include "outq.h"
+
+#define CONFIG_OPTIONS  "dc:m:w:q:o:s:S:b:p:a:l:M:L:B:W:I:T:D:f:P:F:t:r:"
+
+/* config file names of the command line options */
+static const struct {
+    const char* name;
+    int opt;
+} config_names[] = {
+    { "engine", 'm' },
+    { "workers", 'w' },
+    { "queue_depth", 'q' },
+    { "overload", 'o' },
+    { "subscriber_lag", 's' },
+    { "subscriber_policy", 'S' },
+    { "retain_bytes", 'b' },
+    { "retain_packets", 'p' },
+    { "retain_seconds", 'a' },
+    { "log_level", 'l' },
+    { "metrics_port", 'M' },
+    { "listeners", 'L' },
+    { "backlog", 'B' },
+    { "reply_limit", 'W' },
+    { "max_packet", 'I' },
+    { "send_timeout", 'T' },
+    { "drain_seconds", 'D' },
+    { "durability", 'f' },
+    { "port", 'P' },
+    { "data_path", 'F' },
+    { "timestamp_interval", 't' },
+    { "recv_size", 'r' },
+};
+
+static bool config_reloading;
+static int config_argc;
+static char** config_argv;
+static config_t config_active;
+static chan_set_t* config_chans;
+static ticker_t* config_tick;
+static sigs_t* config_sigs;
+
+/* on the terminal while starting, to the log once running */
+static void config_error(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+static void config_error(const char* fmt, ...)
+{
+    char msg[1024];
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, ap);
+    va_end(ap);
+    if (config_reloading)
+    {
+        LOGGER(LOG_ERR, "%s", msg);
+    }
+    else
+    {
+        fprintf(stderr, "%s\n", msg);
+    }
+}
+
+static void config_usage(const char* prog)
+{
+    config_error("Usage: %s [-d] [-c config file] [-m thread|epoll|uring] [-w workers] "
+                 "[-q queue depth] [-o queue|reject|shed] [-s subscriber lag] [-S drop|close] "
+                 "[-b retain bytes] [-p retain packets] [-a retain seconds] [-l log level] "
+                 "[-M metrics port] [-L listeners] [-B backlog] [-W high[,low] reply bytes] "
+                 "[-I max packet bytes] [-T send timeout] [-D drain seconds] "
+                 "[-f memory|buffered|interval[,ms]|always|ring[,packets[,bytes]]] "
+                 "[-P port] [-F data path] [-t timestamp seconds] [-r receive bytes]", prog);
+}
+
+static void config_defaults(config_t* cfg)
+{
+    memset(cfg, 0, sizeof(config_t));
+    cfg->engine = CONFIG_ENGINE_THREAD;
+    cfg->depth = POOL_DEFAULT_DEPTH;
+    cfg->overload = POOL_QUEUE;
+    cfg->lag = PROTO_TAIL_DEFAULT_LAG;
+    cfg->lag_policy = PROTO_LAG_DROP;
+    cfg->log_level = LOG_INFO;
+    cfg->backlog = LSN_DEFAULT_BACKLOG;
+    cfg->out_high = OUTQ_DEFAULT_HIGH;
+    cfg->out_low = OUTQ_DEFAULT_LOW;
+    cfg->in_max = FRAMER_DEFAULT_LIMIT;
+    cfg->send_timeout = POOL_DEFAULT_SEND_TIMEOUT;
+    cfg->drain = SIGS_DEFAULT_DRAIN_SEC;
+    cfg->sync = PSTORE_SYNC_BUFFERED;
+    cfg->sync_ms = PSTORE_DEFAULT_SYNC_MS;
+    cfg->ring_bytes = PSTORE_RING_DEFAULT_BYTES;
+    cfg->tick_sec = TICKER_INTERVAL_SEC;
+    cfg->recv_size = POOL_DEFAULT_RECV_SIZE;
+    strcpy(cfg->port, LSN_PORT);
+    strcpy(cfg->path, filename);
+}
+
+static int config_durability(config_t* cfg, const char* arg)
+{
+    char* end;
+
+    cfg->ring_pkts = 0;
+    if (strcmp(arg, "memory") == 0)
+    {
+        cfg->sync = PSTORE_SYNC_MEMORY;
+    }
+    else if (strcmp(arg, "always") == 0)
+    {
+        cfg->sync = PSTORE_SYNC_ALWAYS;
+    }
+    else if (strcmp(arg, "buffered") == 0)
+    {
+        cfg->sync = PSTORE_SYNC_BUFFERED;
+    }
+    else if (strncmp(arg, "interval", 8) == 0 && (arg[8] == '\0' || arg[8] == ','))
+    {
+        cfg->sync = PSTORE_SYNC_INTERVAL;
+        cfg->sync_ms = (arg[8] == ',') ? strtol(arg + 9, NULL, 10) : PSTORE_DEFAULT_SYNC_MS;
+    }
+    else if (strncmp(arg, "ring", 4) == 0 && (arg[4] == '\0' || arg[4] == ','))
+    {
+        // nothing on disk, the ring is all there is
+        cfg->sync = PSTORE_SYNC_MEMORY;
+        cfg->ring_pkts = PSTORE_RING_DEFAULT_PACKETS;
+        cfg->ring_bytes = PSTORE_RING_DEFAULT_BYTES;
+        if (arg[4] == ',')
+        {
+            cfg->ring_pkts = strtol(arg + 5, &end, 10);
+            cfg->ring_bytes = (*end == ',') ? strtol(end + 1, NULL, 10) : cfg->ring_pkts * 0x1000;
+        }
+        if (cfg->ring_pkts < 1 || cfg->ring_bytes < 1)
+        {
+            config_error("Invalid ring size %s", arg);
+            return -1;
+        }
+    }
+    else
+    {
+        config_error("Unknown durability mode %s", arg);
+        return -1;
+    }
+    return 0;
+}
+
+/* set what option @param opt of the command line sets to @param arg */
+static int config_option(config_t* cfg, int opt, const char* arg)
+{
+    char* end;
+    int level;
+
+    switch (opt)
+    {
+    case 'd':
+        cfg->daemon = true;
+        break;
+    case 'm':
+        if (strcmp(arg, "epoll") == 0)
+        {
+            cfg->engine = CONFIG_ENGINE_EPOLL;
+        }
+        else if (strcmp(arg, "uring") == 0)
+        {
+            cfg->engine = CONFIG_ENGINE_URING;
+        }
+        else if (strcmp(arg, "thread") == 0)
+        {
+            cfg->engine = CONFIG_ENGINE_THREAD;
+        }
+        else
+        {
+            config_error("Unknown engine %s", arg);
+            return -1;
+        }
+        break;
+    case 'w':
+        cfg->workers = strtol(arg, NULL, 10);
+        break;
+    case 'q':
+        cfg->depth = strtol(arg, NULL, 10);
+        break;
+    case 'o':
+        if (strcmp(arg, "reject") == 0)
+        {
+            cfg->overload = POOL_REJECT;
+        }
+        else if (strcmp(arg, "shed") == 0)
+        {
+            cfg->overload = POOL_SHED;
+        }
+        else if (strcmp(arg, "queue") == 0)
+        {
+            cfg->overload = POOL_QUEUE;
+        }
+        else
+        {
+            config_error("Unknown overload policy %s", arg);
+            return -1;
+        }
+        break;
+    case 's':
+        cfg->lag = strtol(arg, NULL, 10);
+        break;
+    case 'S':
+        if (strcmp(arg, "close") == 0)
+        {
+            cfg->lag_policy = PROTO_LAG_CLOSE;
+        }
+        else if (strcmp(arg, "drop") == 0)
+        {
+            cfg->lag_policy = PROTO_LAG_DROP;
+        }
+        else
+        {
+            config_error("Unknown subscriber lag policy %s", arg);
+            return -1;
+        }
+        break;
+    case 'b':
+        cfg->retain_bytes = strtol(arg, NULL, 10);
+        break;
+    case 'p':
+        cfg->retain_pkts = strtol(arg, NULL, 10);
+        break;
+    case 'a':
+        cfg->retain_age = strtol(arg, NULL, 10);
+        break;
+    case 'l':
+        if ((level = logger_parse(arg)) < 0)
+        {
+            config_error("Unknown log level %s", arg);
+            return -1;
+        }
+        cfg->log_level = level;
+        break;
+    case 'M':
+        cfg->metrics_port = strtol(arg, NULL, 10);
+        break;
+    case 'L':
+        cfg->listeners = strtol(arg, NULL, 10);
+        break;
+    case 'B':
+        cfg->backlog = strtol(arg, NULL, 10);
+        break;
+    case 'W':
+        cfg->out_high = strtol(arg, &end, 10);
+        cfg->out_low = (*end == ',') ? strtol(end + 1, NULL, 10) : cfg->out_high / 4;
+        break;
+    case 'I':
+        cfg->in_max = strtol(arg, NULL, 10);
+        break;
+    case 'T':
+        cfg->send_timeout = strtol(arg, NULL, 10);
+        break;
+    case 'D':
+        cfg->drain = strtol(arg, NULL, 10);
+        break;
+    case 'f':
+        return config_durability(cfg, arg);
+    case 'P':
+        if (strlen(arg) >= sizeof(cfg->port))
+        {
+            config_error("Invalid port %s", arg);
+            return -1;
+        }
+        strcpy(cfg->port, arg);
+        break;
+    case 'F':
+        if (strlen(arg) >= sizeof(cfg->path) - CHAN_NAME_MAX - 1)
+        {
+            config_error("Data path %s is too long", arg);
+            return -1;
+        }
+        strcpy(cfg->path, arg);
+        break;
+    case 't':
+        cfg->tick_sec = strtol(arg, NULL, 10);
+        break;
+    case 'r':
+        cfg->recv_size = strtol(arg, NULL, 10);
+        break;
+    }
+    return 0;
+}
+
+/* @return the text between leading and trailing blanks of @param s, cut in place */
+static char* config_trim(char* s)
+{
+    while (isspace((unsigned char)*s))
+    {
+        s++;
+    }
+    size_t len = strlen(s);
+    while (len > 0 && isspace((unsigned char)s[len - 1]))
+    {
+        s[--len] = '\0';
+    }
+    return s;
+}
+
+/* a missing file is only an error if @param required is set */
+static int config_load(config_t* cfg, const char* path, bool required)
+{
+    char line[PATH_MAX + 64];
+    int lineno = 0;
+    int rc = 0;
+
+    FILE* f = fopen(path, "r");
+    if (!f)
+    {
+        if (errno == ENOENT && !required)
+        {
+            return 0;
+        }
+        config_error("Could not open config file %s: %s", path, strerror(errno));
+        return -1;
+    }
+    while (rc == 0 && fgets(line, sizeof(line), f))
+    {
+        lineno++;
+        char* hash = strchr(line, '#');
+        if (hash)
+        {
+            *hash = '\0';
+        }
+        char* name = config_trim(line);
+        if (*name == '\0')
+        {
+            continue;
+        }
+        char* eq = strchr(name, '=');
+        if (!eq)
+        {
+            config_error("%s:%d: expected name = value", path, lineno);
+            rc = -1;
+            break;
+        }
+        *eq = '\0';
+        name = config_trim(name);
+        char* value = config_trim(eq + 1);
+        size_t i;
+        for (i = 0; i < sizeof(config_names) / sizeof(config_names[0]); i++)
+        {
+            if (strcmp(name, config_names[i].name) == 0)
+            {
+                break;
+            }
+        }
+        if (i == sizeof(config_names) / sizeof(config_names[0]))
+        {
+            config_error("%s:%d: unknown setting %s", path, lineno, name);
+            rc = -1;
+        }
+        else if (config_option(cfg, config_names[i].opt, value) != 0)
+        {
+            config_error("%s:%d: invalid %s", path, lineno, name);
+            rc = -1;
+        }
+    }
+    fclose(f);
+    return rc;
+}
+
+/* fill in what depends on other settings and fall back to defaults for what is out of range */
+static void config_normalize(config_t* cfg)
+{
+    cfg->workers_auto = cfg->workers < 1;
+    if (cfg->workers < 1)
+    {
+        // event loops want a thread per cpu, blocking workers need more
+        cfg->workers = (cfg->engine == CONFIG_ENGINE_THREAD) ? POOL_DEFAULT_WORKERS
+                                                             : sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (cfg->workers < 1)
+    {
+        cfg->workers = 1;
+    }
+    if (cfg->listeners < 1)
+    {
+        // an accept loop per cpu, io_uring runs a single one for all
+        cfg->listeners = (cfg->engine == CONFIG_ENGINE_URING) ? 1 : sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (cfg->engine == CONFIG_ENGINE_EPOLL && cfg->listeners > cfg->workers)
+    {
+        // every epoll worker accepts from one listener
+        cfg->listeners = cfg->workers;
+    }
+    if (cfg->listeners < 1)
+    {
+        cfg->listeners = 1;
+    }
+    if (cfg->backlog < 1)
+    {
+        cfg->backlog = LSN_DEFAULT_BACKLOG;
+    }
+    if (cfg->depth < 1)
+    {
+        cfg->depth = 1;
+    }
+    if (cfg->lag < 1)
+    {
+        cfg->lag = PROTO_TAIL_DEFAULT_LAG;
+    }
+    if (cfg->out_high < 1)
+    {
+        cfg->out_high = OUTQ_DEFAULT_HIGH;
+        cfg->out_low = OUTQ_DEFAULT_LOW;
+    }
+    if (cfg->out_low < 0)
+    {
+        cfg->out_low = 0;
+    }
+    if (cfg->in_max < 1)
+    {
+        cfg->in_max = FRAMER_DEFAULT_LIMIT;
+    }
+    if (cfg->send_timeout < 0)
+    {
+        cfg->send_timeout = POOL_DEFAULT_SEND_TIMEOUT;
+    }
+    if (cfg->drain < 0)
+    {
+        cfg->drain = 0;
+    }
+    if (cfg->sync_ms < 1)
+    {
+        cfg->sync_ms = PSTORE_DEFAULT_SYNC_MS;
+    }
+    if (cfg->retain_bytes < 0)
+    {
+        cfg->retain_bytes = 0;
+    }
+    if (cfg->retain_pkts < 0)
+    {
+        cfg->retain_pkts = 0;
+    }
+    if (cfg->retain_age < 0)
+    {
+        cfg->retain_age = 0;
+    }
+    if (cfg->tick_sec < 1)
+    {
+        cfg->tick_sec = TICKER_INTERVAL_SEC;
+    }
+    if (cfg->recv_size < 1)
+    {
+        cfg->recv_size = POOL_DEFAULT_RECV_SIZE;
+    }
+}
+
+static int config_parse(config_t* cfg, int argc, char** argv)
+{
+    const char* path = NULL;
+    int opt;
+
+    // the file goes first so the command line overrides it
+    opterr = !config_reloading;
+    optind = 1;
+    while ((opt = getopt(argc, argv, CONFIG_OPTIONS)) != -1)
+    {
+        if (opt == 'c')
+        {
+            path = optarg;
+        }
+        else if (opt == '?')
+        {
+            config_usage(argv[0]);
+            return -1;
+        }
+    }
+    config_defaults(cfg);
+    if (config_load(cfg, path ? path : CONFIG_DEFAULT_PATH, path != NULL) != 0)
+    {
+        return -1;
+    }
+    optind = 1;
+    while ((opt = getopt(argc, argv, CONFIG_OPTIONS)) != -1)
+    {
+        if (config_option(cfg, opt, optarg) != 0)
+        {
+            return -1;
+        }
+    }
+    config_normalize(cfg);
+    return 0;
+}
+
+int config_init(config_t* cfg, int argc, char** argv)
+{
+    if (config_parse(cfg, argc, argv) != 0)
+    {
+        return -1;
+    }
+    config_argc = argc;
+    config_argv = argv;
+    return 0;
+}
+
+void config_apply(const config_t* cfg)
+{
+    __atomic_store_n(&logger_level, cfg->log_level, __ATOMIC_RELAXED);
+    proto_tail_limit(cfg->lag, cfg->lag_policy);
+    outq_limits(cfg->out_high, cfg->out_low);
+    framer_limit(cfg->in_max);
+    pool_send_timeout(cfg->send_timeout);
+    pool_recv_size(cfg->recv_size);
+}
+
+void config_watch(const config_t* cfg, chan_set_t* chans, ticker_t* tick, sigs_t* sigs)
+{
+    config_active = *cfg;
+    config_chans = chans;
+    config_tick = tick;
+    config_sigs = sigs;
+}
+
+/* @return 1 and log it if @param name changed, only a restart applies it */
+static int config_fixed(const char* name, bool changed)
+{
+    if (changed)
+    {
+        LOGGER(LOG_NOTICE, "Changed %s only takes effect on restart", name);
+    }
+    return changed;
+}
+
+void config_reload(void)
+{
+    config_t cfg;
+    config_t* old = &config_active;
+
+    config_reloading = true;
+    int rc = config_parse(&cfg, config_argc, config_argv);
+    config_reloading = false;
+    if (rc != 0)
+    {
+        LOGGER(LOG_ERR, "Keeping the running configuration");
+        return;
+    }
+
+    // what sized the threads, sockets and stores at start up
+    int fixed = 0;
+    fixed += config_fixed("engine", cfg.engine != old->engine);
+    fixed += config_fixed("workers", cfg.workers != old->workers);
+    fixed += config_fixed("queue_depth", cfg.depth != old->depth);
+    fixed += config_fixed("overload", cfg.overload != old->overload);
+    fixed += config_fixed("metrics_port", cfg.metrics_port != old->metrics_port);
+    fixed += config_fixed("listeners", cfg.listeners != old->listeners);
+    fixed += config_fixed("backlog", cfg.backlog != old->backlog);
+    fixed += config_fixed("port", strcmp(cfg.port, old->port) != 0);
+    fixed += config_fixed("data_path", strcmp(cfg.path, old->path) != 0);
+    fixed += config_fixed("durability", (cfg.sync == PSTORE_SYNC_MEMORY) != (old->sync == PSTORE_SYNC_MEMORY) ||
+                          cfg.ring_pkts != old->ring_pkts || cfg.ring_bytes != old->ring_bytes);
+    cfg.engine = old->engine;
+    cfg.workers = old->workers;
+    cfg.depth = old->depth;
+    cfg.overload = old->overload;
+    cfg.metrics_port = old->metrics_port;
+    cfg.listeners = old->listeners;
+    cfg.backlog = old->backlog;
+    strcpy(cfg.port, old->port);
+    strcpy(cfg.path, old->path);
+    if ((cfg.sync == PSTORE_SYNC_MEMORY) != (old->sync == PSTORE_SYNC_MEMORY))
+    {
+        // a store cannot move between memory and a file
+        cfg.sync = old->sync;
+        cfg.sync_ms = old->sync_ms;
+    }
+    cfg.ring_pkts = old->ring_pkts;
+    cfg.ring_bytes = old->ring_bytes;
+
+    config_apply(&cfg);
+    if (cfg.sync != old->sync || cfg.sync_ms != old->sync_ms)
+    {
+        chan_durability(config_chans, cfg.sync, cfg.sync_ms);
+    }
+    if (cfg.retain_bytes != old->retain_bytes || cfg.retain_pkts != old->retain_pkts ||
+        cfg.retain_age != old->retain_age)
+    {
+        chan_retain(config_chans, cfg.retain_bytes, cfg.retain_pkts, cfg.retain_age);
+    }
+    if (cfg.tick_sec != old->tick_sec && ticker_interval(config_tick, cfg.tick_sec) != 0)
+    {
+        cfg.tick_sec = old->tick_sec;
+    }
+    __atomic_store_n(&config_sigs->drain_ms, cfg.drain * 1000, __ATOMIC_RELAXED);
+    *old = cfg;
+    LOGGER(LOG_INFO, "Reloaded configuration%s", fixed ? ", some changes wait for a restart" : "");
+}
@@ -0,0 +1,92 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <limits.h>
+#include <stdbool.h>
+#include "channels.h"
+#include "packet_store.h"
+#include "pool_server.h"
+#include "protocol.h"
+#include "signals.h"
+#include "ticker.h"
+
+#define CONFIG_DEFAULT_PATH "/etc/aesdsocket.conf"
+
+enum config_engine {
+    CONFIG_ENGINE_THREAD,
+    CONFIG_ENGINE_EPOLL,
+    CONFIG_ENGINE_URING,
+};
+
+/**
+ * Every tunable of the server. Values start from the built in defaults, then
+ * come from the config file, then from the command line, which keeps its
+ * priority when the file is reloaded. The file holds one "name = value" per
+ * line, named after the long form of each option (see config.c), and "#"
+ * starts a comment. The file given with -c must exist, CONFIG_DEFAULT_PATH is
+ * read only if it does.
+ * SIGHUP reads both again. Settings the engines only look up as they go (log
+ * level, retention, durability between file modes, subscriber lag, reply and
+ * packet limits, send timeout, receive size, drain time and timestamp
+ * interval) change for running connections at once. The others size threads,
+ * sockets or stores at start up and only take effect on a restart, which is
+ * logged. A file that fails to parse leaves the running settings alone.
+ */
+typedef struct config_s config_t;
+struct config_s {
+    bool daemon;
+    enum config_engine engine;
+    long workers;
+    bool workers_auto;  // workers was not given, so it follows the engine
+    long depth;
+    enum pool_overload overload;
+    long lag;
+    enum proto_lag lag_policy;
+    long retain_bytes;
+    long retain_pkts;
+    long retain_age;
+    int log_level;
+    long metrics_port;
+    long listeners;
+    long backlog;
+    long out_high;
+    long out_low;
+    long in_max;
+    long send_timeout;
+    long drain;
+    enum pstore_sync sync;
+    long sync_ms;
+    long ring_pkts;
+    long ring_bytes;
+    long tick_sec;
+    long recv_size;
+    char port[16];
+    char path[PATH_MAX];
+};
+
+/**
+* Fill @param cfg from the defaults, the config file and the @param argc
+* arguments in @param argv, which must stay valid for reloads.
+* @return 0 on success, -1 after printing what was wrong.
+*/
+int config_init(config_t* cfg, int argc, char** argv);
+
+/**
+* Hand the settings of @param cfg kept by the protocol, queue, framer, pool
+* and logger modules to them.
+*/
+void config_apply(const config_t* cfg);
+
+/**
+* Have config_reload change @param chans, @param tick and @param sigs, which
+* run with the settings of @param cfg.
+*/
+void config_watch(const config_t* cfg, chan_set_t* chans, ticker_t* tick, sigs_t* sigs);
+
+/**
+* Read the config file and command line again and apply what can change
+* live, on SIGHUP.
+*/
+void config_reload(void);
+
+#endif
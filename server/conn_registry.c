@@ -0,0 +1,218 @@
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include "conn_registry.h"
+#include "logger.h"
+
+#define CREG_NIL    UINT32_MAX
+
+enum creg_state {
+    CREG_FREE,
+    CREG_ACTIVE,
+    CREG_DONE,
+};
+
+/*
+ * next links the slot into the free stack or, once complete, into the done
+ * stack. The free stack head carries a tag in its upper half so a pop racing
+ * with a pop and push of the same slot (ABA) fails its compare and swap.
+ * gen counts the connections the slot held, so a snapshot can tell that the
+ * descriptor it read still belongs to the connection it saw active.
+ */
+struct creg_slot_s {
+    int state;
+    int fd;
+    uint32_t gen;
+    void* conn;
+    uint32_t next;
+};
+
+static void creg_push_free(creg_t* r, uint32_t idx)
+{
+    uint64_t head = __atomic_load_n(&r->free_head, __ATOMIC_RELAXED);
+    uint64_t next;
+    do
+    {
+        __atomic_store_n(&r->slots[idx].next, (uint32_t)head, __ATOMIC_RELAXED);
+        next = (((head >> 32) + 1) << 32) | idx;
+    } while (!__atomic_compare_exchange_n(&r->free_head, &head, next, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static uint32_t creg_pop_free(creg_t* r)
+{
+    uint64_t head = __atomic_load_n(&r->free_head, __ATOMIC_ACQUIRE);
+    uint64_t next;
+    do
+    {
+        uint32_t idx = (uint32_t)head;
+        if (idx == CREG_NIL)
+        {
+            return CREG_NIL;
+        }
+        next = (((head >> 32) + 1) << 32) | __atomic_load_n(&r->slots[idx].next, __ATOMIC_RELAXED);
+    } while (!__atomic_compare_exchange_n(&r->free_head, &head, next, true,
+                                          __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+    return (uint32_t)head;
+}
+
+/* release everything completed so far, @return the number of slots recycled */
+static size_t creg_reclaim(creg_t* r)
+{
+    size_t n = 0;
+    uint32_t idx = __atomic_exchange_n(&r->done_head, CREG_NIL, __ATOMIC_ACQUIRE);
+    while (idx != CREG_NIL)
+    {
+        creg_slot_t* slot = &r->slots[idx];
+        uint32_t next = slot->next;
+        r->release(slot->conn);
+        slot->conn = NULL;
+        __atomic_store_n(&slot->fd, -1, __ATOMIC_RELAXED);
+        __atomic_store_n(&slot->state, CREG_FREE, __ATOMIC_RELEASE);
+        creg_push_free(r, idx);
+        idx = next;
+        n++;
+    }
+    return n;
+}
+
+static void* creg_reclaimer(void* arg)
+{
+    creg_t* r = (creg_t*)arg;
+
+    for (;;)
+    {
+        if (sem_wait(&r->wake) != 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            LOGGER(LOG_ERR, "Connection reclaimer failed to wait: %s", strerror(errno));
+            break;
+        }
+        creg_reclaim(r);
+        if (__atomic_load_n(&r->stop, __ATOMIC_ACQUIRE))
+        {
+            creg_reclaim(r);
+            break;
+        }
+    }
+    return NULL;
+}
+
+int creg_init(creg_t* r, size_t capacity, void (*release)(void* conn))
+{
+    int rc;
+
+    memset(r, 0, sizeof(creg_t));
+    r->capacity = capacity;
+    r->release = release;
+    r->done_head = CREG_NIL;
+    r->free_head = CREG_NIL;
+    r->slots = calloc(capacity, sizeof(creg_slot_t));
+    if (!r->slots)
+    {
+        LOGGER(LOG_ERR, "Could not allocate %zu connection slots", capacity);
+        return -1;
+    }
+    for (size_t i = capacity; i > 0; i--)
+    {
+        r->slots[i - 1].fd = -1;
+        creg_push_free(r, i - 1);
+    }
+    if (sem_init(&r->wake, 0, 0) != 0)
+    {
+        LOGGER(LOG_ERR, "Failed to initialize reclaimer semaphore: %s", strerror(errno));
+        free(r->slots);
+        return -1;
+    }
+    if ((rc = pthread_create(&r->reclaimer, NULL, creg_reclaimer, r)) != 0)
+    {
+        LOGGER(LOG_ERR, "Could not create connection reclaimer thread: %d", rc);
+        sem_destroy(&r->wake);
+        free(r->slots);
+        return -1;
+    }
+    return 0;
+}
+
+void creg_destroy(creg_t* r)
+{
+    __atomic_store_n(&r->stop, true, __ATOMIC_RELEASE);
+    sem_post(&r->wake);
+    pthread_join(r->reclaimer, NULL);
+    sem_destroy(&r->wake);
+    free(r->slots);
+    r->slots = NULL;
+}
+
+int creg_insert(creg_t* r, int fd, void* conn)
+{
+    uint32_t idx = creg_pop_free(r);
+    if (idx == CREG_NIL)
+    {
+        // completed slots may be waiting for the reclaimer, recycle them here
+        creg_reclaim(r);
+        idx = creg_pop_free(r);
+        if (idx == CREG_NIL)
+        {
+            return -1;
+        }
+    }
+    creg_slot_t* slot = &r->slots[idx];
+    __atomic_store_n(&slot->gen, slot->gen + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->fd, fd, __ATOMIC_RELAXED);
+    slot->conn = conn;
+    __atomic_store_n(&slot->state, CREG_ACTIVE, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&r->active, 1, __ATOMIC_RELAXED);
+    return (int)idx;
+}
+
+void creg_complete(creg_t* r, int slot)
+{
+    creg_slot_t* s = &r->slots[slot];
+    __atomic_store_n(&s->state, CREG_DONE, __ATOMIC_RELEASE);
+    __atomic_sub_fetch(&r->active, 1, __ATOMIC_RELAXED);
+
+    uint32_t head = __atomic_load_n(&r->done_head, __ATOMIC_RELAXED);
+    do
+    {
+        __atomic_store_n(&s->next, head, __ATOMIC_RELAXED);
+    } while (!__atomic_compare_exchange_n(&r->done_head, &head, (uint32_t)slot, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    sem_post(&r->wake);
+}
+
+size_t creg_snapshot(creg_t* r, int* fds, size_t max)
+{
+    size_t n = 0;
+    for (size_t i = 0; i < r->capacity && n < max; i++)
+    {
+        creg_slot_t* slot = &r->slots[i];
+        if (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) != CREG_ACTIVE)
+        {
+            continue;
+        }
+        uint32_t gen = __atomic_load_n(&slot->gen, __ATOMIC_RELAXED);
+        int fd = __atomic_load_n(&slot->fd, __ATOMIC_RELAXED);
+        // the fd read above is only used if the same connection is still active
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->state, __ATOMIC_RELAXED) == CREG_ACTIVE &&
+            __atomic_load_n(&slot->gen, __ATOMIC_RELAXED) == gen)
+        {
+            fds[n++] = fd;
+        }
+    }
+    return n;
+}
+
+size_t creg_count(creg_t* r)
+{
+    return __atomic_load_n(&r->active, __ATOMIC_RELAXED);
+}
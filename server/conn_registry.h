@@ -0,0 +1,71 @@
+#ifndef CONN_REGISTRY_H
+#define CONN_REGISTRY_H
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Fixed size table of live connections shared between threads without a lock.
+ * Free slots are kept on a tagged lock-free stack, so inserting and removing
+ * are O(1). A connection is finished by atomically marking its slot complete,
+ * a background reclaimer thread then releases it and recycles the slot.
+ * Snapshots read the slot states directly and never block writers.
+ */
+typedef struct creg_slot_s creg_slot_t;
+
+typedef struct creg_s creg_t;
+struct creg_s {
+    creg_slot_t* slots;
+    size_t capacity;
+    uint64_t free_head;
+    uint32_t done_head;
+    size_t active;
+    void (*release)(void* conn);
+    sem_t wake;
+    bool stop;
+    pthread_t reclaimer;
+};
+
+/**
+* Initialize @param r with room for @param capacity connections, @param release
+* is called from the reclaimer thread for every completed connection.
+* @return 0 on success, -1 on error.
+*/
+int creg_init(creg_t* r, size_t capacity, void (*release)(void* conn));
+
+/**
+* Release completed connections, stop the reclaimer and free @param r.
+*/
+void creg_destroy(creg_t* r);
+
+/**
+* Register connection @param conn on socket @param fd. If no slot is free
+* completed connections are released on the calling thread first.
+* @return its slot, or -1 if the registry is full.
+*/
+int creg_insert(creg_t* r, int fd, void* conn);
+
+/**
+* Mark the connection in @param slot complete and hand it to the reclaimer.
+*/
+void creg_complete(creg_t* r, int slot);
+
+/**
+* Copy the sockets of up to @param max active connections to @param fds. A
+* socket is only copied if its connection was still active after it was read.
+* A connection can still complete, and its descriptor be closed and reused,
+* between the snapshot and the caller using it, so the snapshot is only good
+* for best effort actions like the shutdown at the drain deadline.
+* @return the number copied.
+*/
+size_t creg_snapshot(creg_t* r, int* fds, size_t max);
+
+/**
+* @return the number of connections currently registered and not complete.
+*/
+size_t creg_count(creg_t* r);
+
+#endif
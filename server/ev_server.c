@@ -0,0 +1,780 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include "aesdsocket.h"
+#include "arena.h"
+#include "ev_server.h"
+#include "framer.h"
+#include "logger.h"
+#include "metrics.h"
+#include "outq.h"
+#include "protocol.h"
+#include "queue.h"
+
+#define EV_MAX_EVENTS   256
+#define EV_RECV_CHUNK   0x1000
+#define EV_WAIT_MS      1000
+
+enum ev_state {
+    EV_RECEIVING,
+    EV_COMMITTING,
+    EV_STREAMING,
+};
+
+typedef struct ev_worker_s ev_worker_t;
+
+/*
+ * A connection answers one packet at a time: it receives until the framer
+ * has a complete packet, commits it and queues its reply, then moves on to
+ * the next one. Replies are sent from the output queue as the socket takes
+ * them, in packet order, while later packets are read and committed. Reading
+ * pauses while the queue is over its high watermark and while a packet is
+ * being committed, as it stays in the framer buffer until then.
+ * A subscriber stops reading for good and, once its queue is sent, streams
+ * the log from then on, watching only for the peer hanging up while it is
+ * caught up. store is the channel of the connection, req_store the one of
+ * the packet being committed, which a prefix may have set apart.
+ */
+typedef struct ev_conn_s ev_conn_t;
+struct ev_conn_s {
+    arena_t* arena;
+    int fd;
+    ev_worker_t* w;
+    enum ev_state state;
+    uint32_t events;
+    bool eof;
+    bool failed;
+    size_t served;
+    framer_t in;
+    outq_t out;
+    size_t off;
+    size_t end;
+    pstore_t* store;
+    pstore_t* req_store;
+    pstore_req_t req;
+    metrics_conn_t met;
+    ev_conn_t* next_done;
+    char peer[INET6_ADDRSTRLEN];
+    LIST_ENTRY(ev_conn_s) entries;
+    LIST_ENTRY(ev_conn_s) sub_entries;
+};
+
+/*
+ * Packets go to the store's writer thread while their connection waits
+ * outside epoll. The writer pushes finished connections onto done and bumps
+ * the wfd eventfd, which the worker polls like any other descriptor.
+ * While the worker has subscribers of a channel it also watches its store,
+ * so every batch bumps wfd once and all its idle subscribers are sent the new
+ * bytes. Watches are kept by channel index.
+ */
+struct ev_worker_s {
+    int efd;
+    int sfd;
+    int wfd;
+    ev_conn_t* done;
+    int inflight;
+    pthread_t thread;
+    chan_set_t* chans;
+    ticker_t* tick;
+    sigs_t* sigs;
+    bool draining;
+    pstore_watch_t watches[CHAN_MAX];
+    int nsubs[CHAN_MAX];
+    LIST_HEAD(ev_connhead, ev_conn_s) conns;
+    LIST_HEAD(ev_subhead, ev_conn_s) subs;
+};
+
+static void ev_wake(int wfd)
+{
+    uint64_t one = 1;
+    if (write(wfd, &one, sizeof(one)) < 0)
+    {
+        LOGGER(LOG_ERR, "Could not wake epoll worker: %s", strerror(errno));
+    }
+}
+
+/* called on the store writer thread */
+static void ev_notify(pstore_watch_t* watch)
+{
+    ev_wake(((ev_worker_t*)watch->arg)->wfd);
+}
+
+static void ev_close(ev_conn_t* conn)
+{
+    if (conn->state == EV_STREAMING)
+    {
+        ev_worker_t* w = conn->w;
+        int chan = chan_index(w->chans, conn->store);
+        LIST_REMOVE(conn, sub_entries);
+        if (--w->nsubs[chan] == 0)
+        {
+            pstore_unwatch(conn->store, &w->watches[chan]);
+        }
+        metrics_add(METRICS_UNSUBSCRIBED, 1);
+    }
+    LIST_REMOVE(conn, entries);
+    close(conn->fd);
+    metrics_closed(&conn->met);
+    LOGGER(LOG_INFO, "Closed connection from %s", conn->peer);
+    framer_free(&conn->in);
+    arena_destroy(conn->arena);
+}
+
+static void ev_accept(ev_worker_t* w)
+{
+    while (run)
+    {
+        struct sockaddr_storage addr;
+        socklen_t addrlen = sizeof(addr);
+        int afd = accept4(w->sfd, (struct sockaddr*)&addr, &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (afd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                LOGGER(LOG_ERR, "Error accepting connection: %s", strerror(errno));
+            }
+            return;
+        }
+
+        arena_t* arena = arena_create();
+        ev_conn_t* conn = arena ? arena_alloc(arena, sizeof(ev_conn_t)) : NULL;
+        if (!conn)
+        {
+            LOGGER(LOG_ERR, "Could not allocate memory for connection");
+            if (arena)
+            {
+                arena_destroy(arena);
+            }
+            close(afd);
+            return;
+        }
+        conn->arena = arena;
+        conn->fd = afd;
+        conn->w = w;
+        conn->state = EV_RECEIVING;
+        conn->events = EPOLLIN | EPOLLRDHUP;
+        // channel 0 is the default one
+        conn->store = w->chans->stores[0];
+        framer_init(&conn->in);
+        outq_init(&conn->out);
+        if (getnameinfo((struct sockaddr*)&addr, addrlen, conn->peer, sizeof(conn->peer),
+                        NULL, 0, NI_NUMERICHOST) != 0)
+        {
+            strcpy(conn->peer, "unknown");
+        }
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.ptr = conn;
+        if (epoll_ctl(w->efd, EPOLL_CTL_ADD, afd, &ev) != 0)
+        {
+            LOGGER(LOG_ERR, "Could not add connection to epoll: %s", strerror(errno));
+            close(afd);
+            arena_destroy(arena);
+            continue;
+        }
+        LIST_INSERT_HEAD(&w->conns, conn, entries);
+        metrics_accepted(&conn->met);
+        LOGGER(LOG_INFO, "Accepted connection from %s", conn->peer);
+    }
+}
+
+/**
+ * Wait for @param events on the connection, 0 to leave epoll.
+ * @return 0 on success, -1 on error.
+ */
+static int ev_watch(ev_worker_t* w, ev_conn_t* conn, uint32_t events)
+{
+    if (events == conn->events)
+    {
+        return 0;
+    }
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = conn;
+    int op = !conn->events ? EPOLL_CTL_ADD : (events ? EPOLL_CTL_MOD : EPOLL_CTL_DEL);
+    if (epoll_ctl(w->efd, op, conn->fd, &ev) != 0)
+    {
+        LOGGER(LOG_ERR, "Could not update epoll events of %s: %s", conn->peer, strerror(errno));
+        return -1;
+    }
+    conn->events = events;
+    return 0;
+}
+
+/* called on the store writer thread */
+static void ev_committed(pstore_req_t* req)
+{
+    ev_conn_t* conn = (ev_conn_t*)req->arg;
+    ev_worker_t* w = conn->w;
+
+    conn->next_done = __atomic_load_n(&w->done, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&w->done, &conn->next_done, conn, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+    ev_wake(w->wfd);
+}
+
+/*
+ * Turn the connection into a subscriber. The store is watched before
+ * ev_progress looks at the log size, so no batch can slip through between.
+ */
+static void ev_subscribe(ev_worker_t* w, ev_conn_t* conn)
+{
+    LOGGER(LOG_INFO, "%s subscribed at offset %zu", conn->peer, conn->off);
+    metrics_add(METRICS_SUBSCRIBED, 1);
+    framer_free(&conn->in);
+    conn->state = EV_STREAMING;
+    LIST_INSERT_HEAD(&w->subs, conn, sub_entries);
+    int chan = chan_index(w->chans, conn->store);
+    if (w->nsubs[chan]++ == 0)
+    {
+        pstore_watch(conn->store, &w->watches[chan]);
+    }
+}
+
+/**
+ * Hand the packet to the writer of @param store, the connection reads nothing
+ * until the batch holding it was written. The packet stays in the framer
+ * buffer, which is not touched before then.
+ */
+static void ev_commit(ev_worker_t* w, ev_conn_t* conn, pstore_t* store, const char* pkt, size_t len)
+{
+    memset(&conn->req, 0, sizeof(conn->req));
+    conn->req.buf = pkt;
+    conn->req.len = len;
+    conn->req.complete = ev_committed;
+    conn->req.arg = conn;
+    conn->req_store = store;
+    conn->state = EV_COMMITTING;
+    w->inflight++;
+    metrics_append_start(&conn->met);
+    pstore_submit(store, &conn->req);
+}
+
+/**
+ * Drain the socket into the framer until it holds a complete packet.
+ * @return 0 on success, -1 on error.
+ */
+static int ev_receive(ev_conn_t* conn)
+{
+    while (!conn->eof && !framer_ready(&conn->in))
+    {
+        size_t avail;
+        char* space = framer_space(&conn->in, EV_RECV_CHUNK, &avail);
+        if (!space)
+        {
+            LOGGER(LOG_ERR, "Could not grow receive buffer of %s: %s", conn->peer, strerror(errno));
+            return -1;
+        }
+        ssize_t sz = recv(conn->fd, space, avail, 0);
+        if (sz < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return 0;
+            }
+            LOGGER(LOG_ERR, "Error while waiting for receive data: %s", strerror(errno));
+            return -1;
+        }
+        if (sz == 0)
+        {
+            conn->eof = true;
+            break;
+        }
+        framer_fill(&conn->in, sz);
+        metrics_received(&conn->met, sz);
+    }
+    return 0;
+}
+
+/**
+ * Send the log the subscriber has not been sent yet.
+ * @return 1 once everything was sent, 0 if the socket is full, -1 on error.
+ */
+static int ev_replay(ev_conn_t* conn)
+{
+    size_t from = conn->off;
+    int rc = pstore_send(conn->store, conn->fd, &conn->off, conn->end);
+    metrics_add(METRICS_REPLY_BYTES, conn->off - from);
+    if (rc == 0)
+    {
+        return 1;
+    }
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+    {
+        return 0;
+    }
+    LOGGER(LOG_ERR, "Error sending to %s: %s", conn->peer, strerror(errno));
+    return -1;
+}
+
+/**
+ * Send queued replies until the queue is empty or the socket is full. A
+ * partial write leaves the front reply where it stopped.
+ * @return 1 once everything was sent, 0 if the socket is full, -1 on error.
+ */
+static int ev_flush(ev_conn_t* conn)
+{
+    outq_range_t* r;
+    while ((r = outq_front(&conn->out)) != NULL)
+    {
+        size_t from = r->off;
+        int rc = pstore_send(r->store, conn->fd, &r->off, r->end);
+        outq_sent(&conn->out, from);
+        if (rc != 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return 0;
+            }
+            LOGGER(LOG_ERR, "Error sending to %s: %s", conn->peer, strerror(errno));
+            return -1;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Send what can be sent and work through the buffered packets until the
+ * connection has to wait.
+ * @return 0 while the connection stays open, -1 to close it.
+ */
+static int ev_progress(ev_worker_t* w, ev_conn_t* conn)
+{
+    for (;;)
+    {
+        const char* pkt;
+        size_t len;
+        size_t off, end;
+        pstore_t* store;
+
+        int rc = ev_flush(conn);
+        if (rc < 0)
+        {
+            return -1;
+        }
+        uint32_t out = (rc == 0) ? EPOLLOUT : 0;
+
+        switch (conn->state)
+        {
+        case EV_COMMITTING:
+            return ev_watch(w, conn, out);
+        case EV_STREAMING:
+            if (!run)
+            {
+                return -1;
+            }
+            if (out)
+            {
+                return ev_watch(w, conn, EPOLLOUT | EPOLLRDHUP);
+            }
+            if (conn->off == conn->end && proto_tail(conn->store, &conn->off, &conn->end) != 0)
+            {
+                return -1;
+            }
+            if (conn->off == conn->end)
+            {
+                // caught up, the store watch wakes us for more
+                return ev_watch(w, conn, EPOLLRDHUP);
+            }
+            rc = ev_replay(conn);
+            if (rc <= 0)
+            {
+                return (rc == 0) ? ev_watch(w, conn, EPOLLOUT | EPOLLRDHUP) : -1;
+            }
+            break;
+        case EV_RECEIVING:
+            if (outq_paused(&conn->out))
+            {
+                // the peer reads slower than it sends, wait for it to catch up
+                return ev_watch(w, conn, EPOLLOUT);
+            }
+            if (!framer_next(&conn->in, &pkt, &len))
+            {
+                if (!conn->eof)
+                {
+                    if (!run && !framer_pending(&conn->in) && !out)
+                    {
+                        // shutting down and between packets
+                        return -1;
+                    }
+                    framer_release(&conn->in);
+                    return ev_watch(w, conn, EPOLLIN | EPOLLRDHUP | out);
+                }
+                // peer finished sending, store what is left of an unterminated packet
+                len = framer_rest(&conn->in, &pkt);
+                if (len == 0 && conn->served > 0)
+                {
+                    // close once the last replies are out
+                    return out ? ev_watch(w, conn, EPOLLOUT) : -1;
+                }
+            }
+            metrics_packet(&conn->met, framer_pending(&conn->in));
+            conn->served++;
+            store = conn->store;
+            switch (proto_command(&store, &pkt, &len, &off, &end))
+            {
+            case PROTO_DATA:
+                ev_commit(w, conn, store, pkt, len);
+                break;
+            case PROTO_SUBSCRIBE:
+                conn->store = store;
+                conn->off = off;
+                conn->end = end;
+                ev_subscribe(w, conn);
+                break;
+            case PROTO_CHANNEL:
+                conn->store = store;
+                outq_push(&conn->out, store, off, end);
+                break;
+            case PROTO_REPLY:
+                outq_push(&conn->out, store, off, end);
+                break;
+            }
+            break;
+        }
+    }
+}
+
+/*
+ * A connection whose packet the writer holds is only closed once the writer
+ * is done with it.
+ */
+static void ev_fail(ev_worker_t* w, ev_conn_t* conn)
+{
+    if (conn->state == EV_COMMITTING)
+    {
+        conn->failed = true;
+        ev_watch(w, conn, 0);
+        return;
+    }
+    ev_close(conn);
+}
+
+static void ev_handle(ev_worker_t* w, ev_conn_t* conn, uint32_t events)
+{
+    int rc = 0;
+
+    if (conn->state == EV_RECEIVING && !outq_paused(&conn->out))
+    {
+        rc = ev_receive(conn);
+    }
+    else if (events & (EPOLLERR | EPOLLHUP))
+    {
+        rc = -1;
+    }
+    else if (conn->state == EV_STREAMING && (events & EPOLLRDHUP))
+    {
+        // a subscriber sends nothing more, hanging up ends the subscription
+        rc = -1;
+    }
+
+    if (rc != 0 || ev_progress(w, conn) != 0)
+    {
+        ev_fail(w, conn);
+    }
+}
+
+/* continue connections whose packets the writer completed */
+static void ev_drain_committed(ev_worker_t* w, bool reply)
+{
+    uint64_t cnt;
+    if (read(w->wfd, &cnt, sizeof(cnt)) < 0)
+    {
+        LOGGER(LOG_ERR, "Could not read epoll worker wakeup: %s", strerror(errno));
+    }
+
+    ev_conn_t* conn = __atomic_exchange_n(&w->done, NULL, __ATOMIC_ACQUIRE);
+    while (conn)
+    {
+        ev_conn_t* next = conn->next_done;
+        w->inflight--;
+        conn->state = EV_RECEIVING;
+        if (conn->req.rc == 0 && reply && !conn->failed)
+        {
+            metrics_appended(&conn->met);
+            outq_push(&conn->out, conn->req_store, 0, conn->req.end);
+        }
+        if (conn->req.rc != 0 || !reply || conn->failed || ev_progress(w, conn) != 0)
+        {
+            ev_close(conn);
+        }
+        conn = next;
+    }
+}
+
+/* send new log bytes to every subscriber that is not waiting for its socket */
+static void ev_stream(ev_worker_t* w)
+{
+    ev_conn_t* conn;
+    ev_conn_t* tmp;
+    LIST_FOREACH_SAFE(conn, &w->subs, sub_entries, tmp)
+    {
+        if (!(conn->events & EPOLLOUT) && ev_progress(w, conn) != 0)
+        {
+            ev_close(conn);
+        }
+    }
+}
+
+/*
+ * Stop accepting and close every connection that is between packets, the
+ * others are closed as soon as they get there.
+ */
+static void ev_drain(ev_worker_t* w)
+{
+    ev_conn_t* conn;
+    ev_conn_t* tmp;
+
+    w->draining = true;
+    epoll_ctl(w->efd, EPOLL_CTL_DEL, w->sfd, NULL);
+    // level triggered and never read, it would fire on every wait
+    epoll_ctl(w->efd, EPOLL_CTL_DEL, w->sigs->stopfd, NULL);
+    LIST_FOREACH_SAFE(conn, &w->conns, entries, tmp)
+    {
+        if (conn->state != EV_COMMITTING && ev_progress(w, conn) != 0)
+        {
+            ev_close(conn);
+        }
+    }
+}
+
+static void* ev_worker_thread(void* arg)
+{
+    ev_worker_t* w = (ev_worker_t*)arg;
+    struct epoll_event events[EV_MAX_EVENTS];
+
+    for (;;)
+    {
+        if (!run && !w->draining)
+        {
+            ev_drain(w);
+        }
+        int wait = EV_WAIT_MS;
+        if (w->draining && (LIST_EMPTY(&w->conns) || (wait = sigs_drain_ms(w->sigs)) == 0))
+        {
+            break;
+        }
+        int n = epoll_wait(w->efd, events, EV_MAX_EVENTS, wait);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            LOGGER(LOG_ERR, "Error waiting for events: %s", strerror(errno));
+            break;
+        }
+        for (int i = 0; i < n; i++)
+        {
+            if (events[i].data.ptr == NULL)
+            {
+                ev_accept(w);
+            }
+            else if (events[i].data.ptr == &w->wfd)
+            {
+                ev_drain_committed(w, true);
+                ev_stream(w);
+            }
+            else if (events[i].data.ptr == w->tick)
+            {
+                ticker_expired(w->tick);
+            }
+            else if (events[i].data.ptr == w->sigs)
+            {
+                // stopping, handled at the top of the loop
+            }
+            else
+            {
+                ev_handle(w, (ev_conn_t*)events[i].data.ptr, events[i].events);
+            }
+        }
+    }
+
+    // the writer still holds the packets of committing connections
+    while (w->inflight > 0)
+    {
+        ev_drain_committed(w, false);
+    }
+    while (!LIST_EMPTY(&w->conns))
+    {
+        ev_close(LIST_FIRST(&w->conns));
+    }
+    return NULL;
+}
+
+static void ev_raise_nofile(void)
+{
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &rl) != 0)
+        {
+            LOGGER(LOG_ERR, "Could not raise open file limit: %s", strerror(errno));
+        }
+    }
+}
+
+int ev_server_run(const lsn_set_t* lsn, chan_set_t* chans, ticker_t* tick, sigs_t* sigs, int nworkers)
+{
+    int rc = -1;
+    int started = 0;
+    ev_worker_t* workers = NULL;
+
+    ev_raise_nofile();
+
+    for (int i = 0; i < lsn->count; i++)
+    {
+        int flags = fcntl(lsn->fds[i], F_GETFL);
+        if (flags < 0 || fcntl(lsn->fds[i], F_SETFL, flags | O_NONBLOCK) != 0)
+        {
+            LOGGER(LOG_ERR, "Could not make socket non-blocking: %s", strerror(errno));
+            goto error;
+        }
+    }
+
+    workers = calloc(nworkers, sizeof(ev_worker_t));
+    if (!workers)
+    {
+        LOGGER(LOG_ERR, "Could not allocate memory for %d workers", nworkers);
+        goto error;
+    }
+
+    for (; started < nworkers; started++)
+    {
+        ev_worker_t* w = &workers[started];
+        w->sfd = lsn->fds[started % lsn->count];
+        w->chans = chans;
+        w->sigs = sigs;
+        for (int c = 0; c < CHAN_MAX; c++)
+        {
+            w->watches[c].notify = ev_notify;
+            w->watches[c].arg = w;
+        }
+        LIST_INIT(&w->conns);
+        LIST_INIT(&w->subs);
+        w->efd = epoll_create1(EPOLL_CLOEXEC);
+        if (w->efd < 0)
+        {
+            LOGGER(LOG_ERR, "Could not create epoll instance: %s", strerror(errno));
+            goto stop;
+        }
+        // blocking, it is only read when ready or while draining at shutdown
+        w->wfd = eventfd(0, EFD_CLOEXEC);
+        if (w->wfd < 0)
+        {
+            LOGGER(LOG_ERR, "Could not create worker eventfd: %s", strerror(errno));
+            close(w->efd);
+            goto stop;
+        }
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.ptr = NULL;
+        if (epoll_ctl(w->efd, EPOLL_CTL_ADD, w->sfd, &ev) != 0)
+        {
+            LOGGER(LOG_ERR, "Could not add listener to epoll: %s", strerror(errno));
+            close(w->wfd);
+            close(w->efd);
+            goto stop;
+        }
+        ev.events = EPOLLIN;
+        ev.data.ptr = &w->wfd;
+        if (epoll_ctl(w->efd, EPOLL_CTL_ADD, w->wfd, &ev) != 0)
+        {
+            LOGGER(LOG_ERR, "Could not add eventfd to epoll: %s", strerror(errno));
+            close(w->wfd);
+            close(w->efd);
+            goto stop;
+        }
+        ev.data.ptr = sigs;
+        if (epoll_ctl(w->efd, EPOLL_CTL_ADD, sigs->stopfd, &ev) != 0)
+        {
+            LOGGER(LOG_ERR, "Could not add stop eventfd to epoll: %s", strerror(errno));
+            close(w->wfd);
+            close(w->efd);
+            goto stop;
+        }
+        if (started == 0)
+        {
+            w->tick = tick;
+            ev.data.ptr = tick;
+            if (epoll_ctl(w->efd, EPOLL_CTL_ADD, tick->fd, &ev) != 0)
+            {
+                LOGGER(LOG_ERR, "Could not add timer to epoll: %s", strerror(errno));
+                close(w->wfd);
+                close(w->efd);
+                goto stop;
+            }
+        }
+
+        int prc = pthread_create(&w->thread, NULL, ev_worker_thread, w);
+        if (prc != 0)
+        {
+            LOGGER(LOG_ERR, "Could not create worker thread: %d", prc);
+            close(w->wfd);
+            close(w->efd);
+            goto stop;
+        }
+    }
+    LOGGER(LOG_INFO, "Started %d epoll workers", nworkers);
+    rc = 0;
+
+    // the workers watch stopfd, signals are read here
+    while (run)
+    {
+        struct pollfd pfd;
+        pfd.fd = sigs->fd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, EV_WAIT_MS) > 0)
+        {
+            sigs_read(sigs);
+        }
+    }
+
+stop:
+    sigs_stop(sigs);
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+    }
+    if (started > 0)
+    {
+        // the writers complete batches in order, so once an empty append
+        // returns on every channel no completion can still be touching a worker
+        chan_barrier(chans);
+    }
+    for (int i = 0; i < started; i++)
+    {
+        close(workers[i].wfd);
+        close(workers[i].efd);
+    }
+error:
+    free(workers);
+    return rc;
+}
@@ -0,0 +1,24 @@
+#ifndef EV_SERVER_H
+#define EV_SERVER_H
+
+#include "channels.h"
+#include "listener.h"
+#include "signals.h"
+#include "ticker.h"
+
+/**
+* Serve connections on the listening sockets @param lsn with @param nworkers
+* threads, each running its own non-blocking epoll loop, until run is cleared.
+* Worker i accepts from socket i modulo their count, workers sharing a socket
+* are woken one at a time. Replies wait in a per-connection output queue
+* while the socket is full, reading stops once it is over its high watermark.
+* Packets are appended to and replayed from the channels of @param chans,
+* each connection starting on the default one. The first worker
+* also appends the records of @param tick, the calling thread reads @param sigs.
+* Once stopped, workers serve their connections until they are between packets
+* or the drain deadline passes.
+* @return 0 on a clean shutdown, -1 if the engine could not be started.
+*/
+int ev_server_run(const lsn_set_t* lsn, chan_set_t* chans, ticker_t* tick, sigs_t* sigs, int nworkers);
+
+#endif
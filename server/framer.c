@@ -0,0 +1,165 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "framer.h"
+#include "slab.h"
+
+
+/*
+ * Find the first newline in [p, e). Compares 16 bytes per step with SSE2
+ * where available and leaves the tail, or the whole range elsewhere, to
+ * memchr (which the C library vectorizes for the other targets).
+ */
+static const char* framer_scan(const char* p, const char* e)
+{
+#ifdef __SSE2__
+    const __m128i nl = _mm_set1_epi8('\n');
+    while (e - p >= 64)
+    {
+        __m128i a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)p), nl);
+        __m128i b = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + 16)), nl);
+        __m128i c = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + 32)), nl);
+        __m128i d = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + 48)), nl);
+        if (_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d))))
+        {
+            uint64_t mask = (uint64_t)(unsigned)_mm_movemask_epi8(a) |
+                            (uint64_t)(unsigned)_mm_movemask_epi8(b) << 16 |
+                            (uint64_t)(unsigned)_mm_movemask_epi8(c) << 32 |
+                            (uint64_t)(unsigned)_mm_movemask_epi8(d) << 48;
+            return p + __builtin_ctzll(mask);
+        }
+        p += 64;
+    }
+    while (e - p >= 16)
+    {
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)p), nl));
+        if (mask)
+        {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+#endif
+    return (p < e) ? memchr(p, '\n', e - p) : NULL;
+}
+
+static size_t framer_max = FRAMER_DEFAULT_LIMIT;
+
+void framer_limit(size_t max)
+{
+    __atomic_store_n(&framer_max, max, __ATOMIC_RELAXED);
+}
+
+void framer_init(framer_t* f)
+{
+    memset(f, 0, sizeof(framer_t));
+}
+
+void framer_free(framer_t* f)
+{
+    slab_put(f->buf, f->cap);
+    framer_init(f);
+}
+
+char* framer_space(framer_t* f, size_t min, size_t* avail)
+{
+    if (f->start > 0)
+    {
+        memmove(f->buf, f->buf + f->start, f->len - f->start);
+        f->len -= f->start;
+        f->scan -= f->start;
+        f->start = 0;
+    }
+    // reloads change the limit, use the same one throughout
+    size_t max = __atomic_load_n(&framer_max, __ATOMIC_RELAXED);
+    if (f->len >= max)
+    {
+        errno = EMSGSIZE;
+        return NULL;
+    }
+    if (min > max - f->len)
+    {
+        min = max - f->len;
+    }
+    if (f->cap - f->len < min)
+    {
+        // grow at least twofold so a long packet is copied O(log n) times
+        size_t cap = (f->len + min > 2 * f->cap) ? f->len + min : 2 * f->cap;
+        char* buf = slab_get(cap, &cap);
+        if (!buf)
+        {
+            errno = ENOMEM;
+            return NULL;
+        }
+        if (f->len > 0)
+        {
+            memcpy(buf, f->buf, f->len);
+        }
+        slab_put(f->buf, f->cap);
+        f->buf = buf;
+        f->cap = cap;
+    }
+    *avail = f->cap - f->len;
+    if (*avail > max - f->len)
+    {
+        *avail = max - f->len;
+    }
+    return f->buf + f->len;
+}
+
+void framer_fill(framer_t* f, size_t n)
+{
+    f->len += n;
+}
+
+bool framer_ready(framer_t* f)
+{
+    if (f->scan == f->len)
+    {
+        return false;
+    }
+    // stop on the newline so framer_next finds it again without a rescan
+    const char* nl = framer_scan(f->buf + f->scan, f->buf + f->len);
+    f->scan = nl ? (size_t)(nl - f->buf) : f->len;
+    return nl != NULL;
+}
+
+bool framer_next(framer_t* f, const char** pkt, size_t* len)
+{
+    if (!framer_ready(f))
+    {
+        return false;
+    }
+    *pkt = f->buf + f->start;
+    *len = f->scan + 1 - f->start;
+    f->start += *len;
+    f->scan = f->start;
+    return true;
+}
+
+bool framer_pending(framer_t* f)
+{
+    return f->len > f->start;
+}
+
+size_t framer_rest(framer_t* f, const char** pkt)
+{
+    size_t len = f->len - f->start;
+    *pkt = f->buf + f->start;
+    f->start = f->len;
+    f->scan = f->len;
+    return len;
+}
+
+void framer_release(framer_t* f)
+{
+    if (f->start == f->len)
+    {
+        framer_free(f);
+    }
+}
@@ -0,0 +1,76 @@
+#ifndef FRAMER_H
+#define FRAMER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define FRAMER_DEFAULT_LIMIT    0x4000000
+
+/**
+ * Splits a received byte stream into newline terminated packets. Bytes are
+ * received straight into the framer buffer and packets are returned as
+ * pointers into it, so a packet split over several receives or several
+ * packets in one receive are handled without extra copies. Bytes already
+ * searched are never scanned for a newline again. Buffers come from and go
+ * back to the slab pool.
+ */
+typedef struct framer_s framer_t;
+struct framer_s {
+    char* buf;
+    size_t start;
+    size_t scan;
+    size_t len;
+    size_t cap;
+};
+
+/**
+* Refuse to buffer more than @param max bytes of one connection, for all
+* connections. A packet that does not fit can never be completed.
+*/
+void framer_limit(size_t max);
+
+void framer_init(framer_t* f);
+
+void framer_free(framer_t* f);
+
+/**
+* Make room for at least @param min more bytes, dropping packets already
+* returned. Pointers to earlier packets are invalid afterwards.
+* @return where to receive up to *@param avail bytes, NULL with errno set to
+* EMSGSIZE if the buffer is at its limit or ENOMEM if out of memory.
+*/
+char* framer_space(framer_t* f, size_t min, size_t* avail);
+
+/**
+* Account for @param n bytes received at the pointer framer_space returned.
+*/
+void framer_fill(framer_t* f, size_t n);
+
+/**
+* @return true if a complete packet is buffered.
+*/
+bool framer_ready(framer_t* f);
+
+/**
+* Find the next complete packet, including its newline.
+* @return true and set *@param pkt and *@param len if there is one.
+*/
+bool framer_next(framer_t* f, const char** pkt, size_t* len);
+
+/**
+* @return true if bytes past the packets returned so far are buffered.
+*/
+bool framer_pending(framer_t* f);
+
+/**
+* Take the bytes of a packet left unterminated when the peer stopped sending.
+* @return their length, stored at *@param pkt.
+*/
+size_t framer_rest(framer_t* f, const char** pkt);
+
+/**
+* Free the buffer if it holds no unconsumed bytes, for idle connections.
+*/
+void framer_release(framer_t* f);
+
+#endif
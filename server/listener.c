@@ -0,0 +1,114 @@
+#include <errno.h>
+#include <netdb.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "listener.h"
+#include "logger.h"
+
+/* @return a socket bound to @param ai, -1 on error with errno set */
+static int lsn_bind(const struct addrinfo* ai, bool shared)
+{
+    const int enable = 1;
+    const int disable = 0;
+    int fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) != 0 ||
+        (shared && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(int)) != 0) ||
+        (ai->ai_family == AF_INET6 &&
+         setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &disable, sizeof(int)) != 0) ||
+        bind(fd, ai->ai_addr, ai->ai_addrlen) != 0)
+    {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+int lsn_open(lsn_set_t* set, const char* port, int count)
+{
+    static const int families[] = { AF_INET6, AF_INET };
+
+    set->count = 0;
+    set->fds = calloc(count, sizeof(int));
+    if (!set->fds)
+    {
+        LOGGER(LOG_ERR, "Could not allocate memory for %d listeners", count);
+        return -1;
+    }
+    for (size_t f = 0; f < sizeof(families) / sizeof(families[0]) && set->count == 0; f++)
+    {
+        struct addrinfo hints;
+        struct addrinfo* res = NULL;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_flags = AI_PASSIVE;
+        hints.ai_family = families[f];
+        hints.ai_socktype = SOCK_STREAM;
+        int status = getaddrinfo(NULL, port, &hints, &res);
+        if (status != 0)
+        {
+            LOGGER(LOG_DEBUG, "No %s address for port %s: %s",
+                   (families[f] == AF_INET6) ? "IPv6" : "IPv4", port, gai_strerror(status));
+            continue;
+        }
+        for (; set->count < count; set->count++)
+        {
+            int fd = lsn_bind(res, count > 1);
+            if (fd < 0)
+            {
+                // a host without IPv6 support falls back to IPv4
+                if (set->count > 0 || errno != EAFNOSUPPORT)
+                {
+                    LOGGER(LOG_ERR, "Error binding socket: %s", strerror(errno));
+                    freeaddrinfo(res);
+                    lsn_close(set);
+                    return -1;
+                }
+                break;
+            }
+            set->fds[set->count] = fd;
+        }
+        freeaddrinfo(res);
+    }
+    if (set->count == 0)
+    {
+        LOGGER(LOG_ERR, "Could not bind port %s", port);
+        lsn_close(set);
+        return -1;
+    }
+    return 0;
+}
+
+int lsn_listen(lsn_set_t* set, int backlog)
+{
+    for (int i = 0; i < set->count; i++)
+    {
+        if (listen(set->fds[i], backlog) != 0)
+        {
+            LOGGER(LOG_ERR, "Error listening for connection: %s", strerror(errno));
+            return -1;
+        }
+    }
+    LOGGER(LOG_INFO, "Listening with %d sockets, backlog %d", set->count, backlog);
+    return 0;
+}
+
+void lsn_close(lsn_set_t* set)
+{
+    for (int i = 0; i < set->count; i++)
+    {
+        shutdown(set->fds[i], SHUT_RDWR);
+        close(set->fds[i]);
+    }
+    free(set->fds);
+    set->fds = NULL;
+    set->count = 0;
+}
@@ -0,0 +1,39 @@
+#ifndef LISTENER_H
+#define LISTENER_H
+
+#define LSN_PORT            "9000"
+#define LSN_DEFAULT_BACKLOG 4096
+
+/**
+ * Listening sockets sharing one port with SO_REUSEPORT. The kernel spreads
+ * new connections over them, so every socket can have its own accept loop
+ * and its own queue instead of one thread taking all connections off one
+ * queue. The sockets are dual-stack IPv6, which takes IPv4 connections as
+ * mapped addresses, or IPv4 only where the host has no IPv6.
+ */
+typedef struct lsn_set_s lsn_set_t;
+struct lsn_set_s {
+    int* fds;
+    int count;
+};
+
+/**
+* Bind @param count sockets to @param port on all addresses. SO_REUSEPORT is
+* only set for more than one socket, so a single socket still fails to bind a
+* port in use.
+* @return 0 on success, -1 on error with nothing left open.
+*/
+int lsn_open(lsn_set_t* set, const char* port, int count);
+
+/**
+* Start listening on every socket with a queue of @param backlog connections.
+* @return 0 on success, -1 on error.
+*/
+int lsn_listen(lsn_set_t* set, int backlog);
+
+/**
+* Shut down and close every socket.
+*/
+void lsn_close(lsn_set_t* set);
+
+#endif
@@ -0,0 +1,233 @@
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include "logger.h"
+
+/*
+ * Bounded multi-producer ring in the style of Vyukov's queue: a slot is free
+ * for the writer at position pos when its seq is pos and holds a record for
+ * the reader when seq is pos + 1. Producers claim positions with a compare
+ * and swap on tail, the single reader owns head. logger_stop closes the ring
+ * by setting LOGGER_CLOSED in tail, after which nothing more can be claimed
+ * and the drain thread waits for the slots claimed before to be published.
+ * The drain thread sleeps on the semaphore only after it set sleeping and
+ * found the ring still empty, producers post it only when it is set.
+ */
+#define LOGGER_CLOSED   ((size_t)1 << (sizeof(size_t) * 8 - 1))
+
+typedef struct logger_slot_s logger_slot_t;
+struct logger_slot_s {
+    size_t seq;
+    int prio;
+    char msg[LOGGER_MSG_SIZE];
+};
+
+int logger_level = LOG_INFO;
+
+static logger_slot_t logger_ring[LOGGER_SLOTS];
+static size_t logger_tail;
+static size_t logger_head;
+static size_t logger_dropped;
+static sem_t logger_wake;
+static pthread_t logger_thread;
+static bool logger_running;
+static bool logger_stopping;
+static bool logger_sleeping;
+
+static const struct {
+    const char* name;
+    int prio;
+} logger_names[] = {
+    { "emerg", LOG_EMERG },
+    { "alert", LOG_ALERT },
+    { "crit", LOG_CRIT },
+    { "err", LOG_ERR },
+    { "warning", LOG_WARNING },
+    { "notice", LOG_NOTICE },
+    { "info", LOG_INFO },
+    { "debug", LOG_DEBUG },
+};
+
+/* @return the next record, or false if the ring is empty */
+static bool logger_pop(int* prio, char* msg)
+{
+    logger_slot_t* slot = &logger_ring[logger_head % LOGGER_SLOTS];
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != logger_head + 1)
+    {
+        return false;
+    }
+    *prio = slot->prio;
+    memcpy(msg, slot->msg, LOGGER_MSG_SIZE);
+    __atomic_store_n(&slot->seq, logger_head + LOGGER_SLOTS, __ATOMIC_RELEASE);
+    logger_head++;
+    return true;
+}
+
+static void logger_drain(void)
+{
+    char msg[LOGGER_MSG_SIZE];
+    int prio;
+
+    while (logger_pop(&prio, msg))
+    {
+        syslog(prio, "%s", msg);
+    }
+    size_t dropped = __atomic_exchange_n(&logger_dropped, 0, __ATOMIC_RELAXED);
+    if (dropped > 0)
+    {
+        syslog(LOG_WARNING, "Dropped %zu log records, the ring was full", dropped);
+    }
+}
+
+/* @return true if the record at head is published */
+static bool logger_ready(void)
+{
+    logger_slot_t* slot = &logger_ring[logger_head % LOGGER_SLOTS];
+    return __atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST) == logger_head + 1;
+}
+
+static void* logger_main(void* arg)
+{
+    while (!__atomic_load_n(&logger_stopping, __ATOMIC_ACQUIRE))
+    {
+        logger_drain();
+        // sequentially consistent with the publishing store in logger_write,
+        // so either the producer sees the flag or the record is seen here
+        __atomic_store_n(&logger_sleeping, true, __ATOMIC_SEQ_CST);
+        if (!logger_ready() && !__atomic_load_n(&logger_stopping, __ATOMIC_ACQUIRE))
+        {
+            sem_wait(&logger_wake);
+        }
+        __atomic_store_n(&logger_sleeping, false, __ATOMIC_RELAXED);
+    }
+    // the ring is closed, wait for the producers that claimed a slot before
+    size_t end = __atomic_load_n(&logger_tail, __ATOMIC_ACQUIRE) & ~LOGGER_CLOSED;
+    for (;;)
+    {
+        logger_drain();
+        if (logger_head == end)
+        {
+            break;
+        }
+        sched_yield();
+    }
+    return NULL;
+}
+
+void logger_write(int prio, const char* fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    if (!__atomic_load_n(&logger_running, __ATOMIC_ACQUIRE))
+    {
+        vsyslog(prio, fmt, ap);
+        va_end(ap);
+        return;
+    }
+
+    logger_slot_t* slot;
+    size_t pos = __atomic_load_n(&logger_tail, __ATOMIC_RELAXED);
+    for (;;)
+    {
+        if (pos & LOGGER_CLOSED)
+        {
+            // logger_stop got here first
+            vsyslog(prio, fmt, ap);
+            va_end(ap);
+            return;
+        }
+        slot = &logger_ring[pos % LOGGER_SLOTS];
+        size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq == pos)
+        {
+            if (__atomic_compare_exchange_n(&logger_tail, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        }
+        else if ((ptrdiff_t)(seq - pos) < 0)
+        {
+            // the drain thread is a full ring behind
+            __atomic_fetch_add(&logger_dropped, 1, __ATOMIC_RELAXED);
+            va_end(ap);
+            return;
+        }
+        else
+        {
+            pos = __atomic_load_n(&logger_tail, __ATOMIC_RELAXED);
+        }
+    }
+    slot->prio = prio;
+    vsnprintf(slot->msg, LOGGER_MSG_SIZE, fmt, ap);
+    va_end(ap);
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_SEQ_CST);
+    // only the producer clearing the flag wakes the drain thread
+    if (__atomic_load_n(&logger_sleeping, __ATOMIC_SEQ_CST) &&
+        __atomic_exchange_n(&logger_sleeping, false, __ATOMIC_ACQ_REL))
+    {
+        sem_post(&logger_wake);
+    }
+}
+
+int logger_parse(const char* name)
+{
+    for (size_t i = 0; i < sizeof(logger_names) / sizeof(logger_names[0]); i++)
+    {
+        if (strcmp(name, logger_names[i].name) == 0)
+        {
+            return logger_names[i].prio;
+        }
+    }
+    return -1;
+}
+
+int logger_start(void)
+{
+    int rc;
+
+    for (size_t i = 0; i < LOGGER_SLOTS; i++)
+    {
+        logger_ring[i].seq = i;
+    }
+    logger_head = 0;
+    logger_tail = 0;
+    logger_stopping = false;
+    logger_sleeping = false;
+    if (sem_init(&logger_wake, 0, 0) != 0)
+    {
+        syslog(LOG_ERR, "Failed to initialize logger semaphore");
+        return -1;
+    }
+    if ((rc = pthread_create(&logger_thread, NULL, logger_main, NULL)) != 0)
+    {
+        syslog(LOG_ERR, "Could not create logger thread: %d", rc);
+        sem_destroy(&logger_wake);
+        return -1;
+    }
+    __atomic_store_n(&logger_running, true, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void logger_stop(void)
+{
+    if (!__atomic_load_n(&logger_running, __ATOMIC_ACQUIRE))
+    {
+        return;
+    }
+    // records started after this go straight to syslog
+    __atomic_store_n(&logger_running, false, __ATOMIC_RELEASE);
+    // and so do the ones that had not claimed a slot yet, the drain thread
+    // waits for those that had
+    __atomic_fetch_or(&logger_tail, LOGGER_CLOSED, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&logger_stopping, true, __ATOMIC_RELEASE);
+    sem_post(&logger_wake);
+    pthread_join(logger_thread, NULL);
+    sem_destroy(&logger_wake);
+}
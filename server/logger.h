@@ -0,0 +1,57 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <stdbool.h>
+#include <syslog.h>
+
+/**
+ * Leveled logging that stays off the hot path. LOGGER records above
+ * LOGGER_LEVEL_MAX are compiled out, records above the runtime level cost one
+ * compare and their arguments are not evaluated. Enabled records are
+ * formatted into a slot of a lock-free ring and a background thread hands
+ * them to syslog, so callers never block on the syslog socket. Records that
+ * find the ring full are dropped and counted. Until logger_start runs, and
+ * after logger_stop, records go to syslog directly.
+ */
+#ifndef LOGGER_LEVEL_MAX
+#define LOGGER_LEVEL_MAX    LOG_DEBUG
+#endif
+
+#define LOGGER_SLOTS        4096
+#define LOGGER_MSG_SIZE     240
+
+extern int logger_level;
+
+#define LOGGER(prio, ...)                                               \
+    do                                                                  \
+    {                                                                   \
+        if ((prio) <= LOGGER_LEVEL_MAX &&                               \
+            (prio) <= __atomic_load_n(&logger_level, __ATOMIC_RELAXED)) \
+        {                                                               \
+            logger_write((prio), __VA_ARGS__);                          \
+        }                                                               \
+    } while (0)
+
+/**
+* Format a record, use LOGGER instead.
+*/
+void logger_write(int prio, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+/**
+* Parse a level name as used by syslog (debug, info, notice, warning, err, ...).
+* @return the level, -1 if @param name is not one.
+*/
+int logger_parse(const char* name);
+
+/**
+* Start the thread draining records to syslog.
+* @return 0 on success, -1 on error.
+*/
+int logger_start(void);
+
+/**
+* Drain the remaining records and stop the thread.
+*/
+void logger_stop(void);
+
+#endif
@@ -0,0 +1,413 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "logger.h"
+#include "metrics.h"
+
+#define METRICS_WAIT_MS     1000
+#define METRICS_REPLY_SIZE  0x2000
+
+typedef struct metrics_shard_s metrics_shard_t;
+struct metrics_shard_s {
+    uint64_t counters[METRICS_COUNTERS];
+    uint64_t buckets[METRICS_HISTS][METRICS_BUCKETS];
+    uint64_t max[METRICS_HISTS];
+    bool owned;
+    metrics_shard_t* next;
+};
+
+static const char* const metrics_counter_names[METRICS_COUNTERS] = {
+    "connections_accepted",
+    "connections_closed",
+    "bytes_received",
+    "packets_received",
+    "packets_appended",
+    "replies_sent",
+    "reply_bytes_sent",
+    "subscribers_joined",
+    "subscribers_left",
+    "accept_queue_pushed",
+    "accept_queue_popped",
+    "accept_queue_rejected",
+    "accept_queue_shed",
+    "store_appends_submitted",
+    "store_appends_committed",
+    "store_batches_written",
+    "store_syncs",
+};
+
+static const char* const metrics_hist_names[METRICS_HISTS] = {
+    "accept_to_first_byte_ns",
+    "packet_assembly_ns",
+    "append_ns",
+    "reply_ns",
+    "store_batch_ns",
+    "store_sync_ns",
+};
+
+static metrics_shard_t* metrics_shards;
+static pthread_once_t metrics_once = PTHREAD_ONCE_INIT;
+static pthread_key_t metrics_key;
+static __thread metrics_shard_t* metrics_mine;
+static pthread_t metrics_thread;
+static int metrics_fd = -1;
+static bool metrics_stopping;
+
+/* a thread exiting hands its shard, counts and all, to the next new thread */
+static void metrics_release(void* arg)
+{
+    __atomic_store_n(&((metrics_shard_t*)arg)->owned, false, __ATOMIC_RELEASE);
+}
+
+static void metrics_init(void)
+{
+    if (pthread_key_create(&metrics_key, metrics_release) != 0)
+    {
+        LOGGER(LOG_ERR, "Could not create metrics thread key, shards of exiting threads are not reused");
+    }
+}
+
+static metrics_shard_t* metrics_shard(void)
+{
+    if (metrics_mine)
+    {
+        return metrics_mine;
+    }
+    pthread_once(&metrics_once, metrics_init);
+
+    metrics_shard_t* shard;
+    for (shard = __atomic_load_n(&metrics_shards, __ATOMIC_ACQUIRE); shard; shard = shard->next)
+    {
+        bool owned = false;
+        if (__atomic_compare_exchange_n(&shard->owned, &owned, true, false,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+            break;
+        }
+    }
+    if (!shard)
+    {
+        shard = calloc(1, sizeof(metrics_shard_t));
+        if (!shard)
+        {
+            return NULL;
+        }
+        shard->owned = true;
+        shard->next = __atomic_load_n(&metrics_shards, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&metrics_shards, &shard->next, shard, true,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+    pthread_setspecific(metrics_key, shard);
+    metrics_mine = shard;
+    return shard;
+}
+
+/* only the owning thread writes, so no read-modify-write is needed */
+static void metrics_bump(uint64_t* v, uint64_t n)
+{
+    __atomic_store_n(v, __atomic_load_n(v, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static size_t metrics_bucket(uint64_t v)
+{
+    if (v < (1u << METRICS_SUB_BITS))
+    {
+        return v;
+    }
+    int e = 63 - __builtin_clzll(v);
+    size_t sub = (v >> (e - METRICS_SUB_BITS)) & ((1u << METRICS_SUB_BITS) - 1);
+    return ((size_t)(e - METRICS_SUB_BITS + 1) << METRICS_SUB_BITS) + sub;
+}
+
+/* @return the middle of the values counted in bucket @param b */
+static uint64_t metrics_value(size_t b)
+{
+    if (b < (1u << METRICS_SUB_BITS))
+    {
+        return b;
+    }
+    int e = (b >> METRICS_SUB_BITS) + METRICS_SUB_BITS - 1;
+    uint64_t sub = b & ((1u << METRICS_SUB_BITS) - 1);
+    uint64_t width = 1ull << (e - METRICS_SUB_BITS);
+    return (((1ull << METRICS_SUB_BITS) + sub) << (e - METRICS_SUB_BITS)) + width / 2;
+}
+
+uint64_t metrics_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void metrics_add(enum metrics_counter c, uint64_t n)
+{
+    metrics_shard_t* shard = metrics_shard();
+    if (shard)
+    {
+        metrics_bump(&shard->counters[c], n);
+    }
+}
+
+void metrics_record(enum metrics_hist h, uint64_t ns)
+{
+    metrics_shard_t* shard = metrics_shard();
+    if (shard)
+    {
+        metrics_bump(&shard->buckets[h][metrics_bucket(ns)], 1);
+        if (ns > __atomic_load_n(&shard->max[h], __ATOMIC_RELAXED))
+        {
+            __atomic_store_n(&shard->max[h], ns, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void metrics_accepted(metrics_conn_t* m)
+{
+    memset(m, 0, sizeof(metrics_conn_t));
+    m->accepted = metrics_now();
+    metrics_add(METRICS_ACCEPTED, 1);
+}
+
+void metrics_received(metrics_conn_t* m, size_t n)
+{
+    if (!m->received || !m->packet)
+    {
+        uint64_t now = metrics_now();
+        if (!m->received)
+        {
+            m->received = true;
+            metrics_record(METRICS_FIRST_BYTE, now - m->accepted);
+        }
+        if (!m->packet)
+        {
+            m->packet = now;
+        }
+    }
+    metrics_add(METRICS_BYTES_IN, n);
+}
+
+void metrics_packet(metrics_conn_t* m, bool more)
+{
+    uint64_t now = metrics_now();
+    if (m->packet)
+    {
+        metrics_record(METRICS_ASSEMBLY, now - m->packet);
+    }
+    m->packet = more ? now : 0;
+    metrics_add(METRICS_PACKETS, 1);
+}
+
+void metrics_append_start(metrics_conn_t* m)
+{
+    m->op = metrics_now();
+}
+
+void metrics_appended(metrics_conn_t* m)
+{
+    metrics_record(METRICS_APPEND, metrics_now() - m->op);
+    metrics_add(METRICS_APPENDS, 1);
+}
+
+void metrics_reply_start(metrics_conn_t* m, size_t off)
+{
+    m->op = metrics_now();
+    m->reply_off = off;
+}
+
+void metrics_replied(metrics_conn_t* m, size_t off)
+{
+    metrics_reply(m->op);
+    metrics_add(METRICS_REPLY_BYTES, (off > m->reply_off) ? off - m->reply_off : 0);
+}
+
+void metrics_reply(uint64_t started)
+{
+    metrics_record(METRICS_REPLY, metrics_now() - started);
+    metrics_add(METRICS_REPLIES, 1);
+}
+
+void metrics_closed(metrics_conn_t* m)
+{
+    metrics_add(METRICS_CLOSED, 1);
+}
+
+/*
+ * @return the value at fraction @param q of the @param count values in @param buckets,
+ * at most @param max, the largest one recorded.
+ */
+static uint64_t metrics_quantile(const uint64_t* buckets, uint64_t count, uint64_t max, double q)
+{
+    uint64_t want = (uint64_t)(q * count);
+    uint64_t seen = 0;
+    for (size_t b = 0; b < METRICS_BUCKETS; b++)
+    {
+        seen += buckets[b];
+        if (seen > want)
+        {
+            uint64_t v = metrics_value(b);
+            return (v < max) ? v : max;
+        }
+    }
+    return 0;
+}
+
+size_t metrics_format(char* buf, size_t len)
+{
+    static uint64_t buckets[METRICS_BUCKETS];
+    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    uint64_t counters[METRICS_COUNTERS] = { 0 };
+    size_t n = 0;
+
+#define METRICS_PRINT(...)                                              \
+    do                                                                  \
+    {                                                                   \
+        int r = snprintf(buf + n, len - n, __VA_ARGS__);                \
+        n = (r < 0 || (size_t)r >= len - n) ? len - 1 : n + r;          \
+    } while (0)
+
+    metrics_shard_t* head = __atomic_load_n(&metrics_shards, __ATOMIC_ACQUIRE);
+    for (metrics_shard_t* s = head; s; s = s->next)
+    {
+        for (int c = 0; c < METRICS_COUNTERS; c++)
+        {
+            counters[c] += __atomic_load_n(&s->counters[c], __ATOMIC_RELAXED);
+        }
+    }
+    for (int c = 0; c < METRICS_COUNTERS; c++)
+    {
+        METRICS_PRINT("%s %llu\n", metrics_counter_names[c], (unsigned long long)counters[c]);
+    }
+    METRICS_PRINT("connections_active %lld\n",
+                  (long long)(counters[METRICS_ACCEPTED] - counters[METRICS_CLOSED]));
+    METRICS_PRINT("subscribers_active %lld\n",
+                  (long long)(counters[METRICS_SUBSCRIBED] - counters[METRICS_UNSUBSCRIBED]));
+    METRICS_PRINT("accept_queue_depth %lld\n",
+                  (long long)(counters[METRICS_QUEUED] - counters[METRICS_DEQUEUED]));
+    METRICS_PRINT("store_queue_depth %lld\n",
+                  (long long)(counters[METRICS_SUBMITTED] - counters[METRICS_COMMITTED]));
+
+    // the merge buffer is too large for a thread stack
+    pthread_mutex_lock(&lock);
+    for (int h = 0; h < METRICS_HISTS; h++)
+    {
+        uint64_t count = 0;
+        uint64_t max = 0;
+        memset(buckets, 0, sizeof(buckets));
+        for (metrics_shard_t* s = head; s; s = s->next)
+        {
+            for (size_t b = 0; b < METRICS_BUCKETS; b++)
+            {
+                uint64_t v = __atomic_load_n(&s->buckets[h][b], __ATOMIC_RELAXED);
+                buckets[b] += v;
+                count += v;
+            }
+            uint64_t m = __atomic_load_n(&s->max[h], __ATOMIC_RELAXED);
+            max = (m > max) ? m : max;
+        }
+        METRICS_PRINT("%s count=%llu p50=%llu p90=%llu p99=%llu p999=%llu max=%llu\n",
+                      metrics_hist_names[h], (unsigned long long)count,
+                      (unsigned long long)metrics_quantile(buckets, count, max, 0.5),
+                      (unsigned long long)metrics_quantile(buckets, count, max, 0.9),
+                      (unsigned long long)metrics_quantile(buckets, count, max, 0.99),
+                      (unsigned long long)metrics_quantile(buckets, count, max, 0.999),
+                      (unsigned long long)max);
+    }
+    pthread_mutex_unlock(&lock);
+#undef METRICS_PRINT
+    return n;
+}
+
+static void* metrics_main(void* arg)
+{
+    char reply[METRICS_REPLY_SIZE];
+
+    while (!__atomic_load_n(&metrics_stopping, __ATOMIC_ACQUIRE))
+    {
+        struct pollfd pfd = { .fd = metrics_fd, .events = POLLIN };
+        if (poll(&pfd, 1, METRICS_WAIT_MS) <= 0)
+        {
+            continue;
+        }
+        int fd = accept4(metrics_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            continue;
+        }
+        size_t len = metrics_format(reply, sizeof(reply));
+        for (size_t off = 0; off < len;)
+        {
+            ssize_t sz = send(fd, reply + off, len - off, MSG_NOSIGNAL);
+            if (sz < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                break;
+            }
+            off += sz;
+        }
+        close(fd);
+    }
+    return NULL;
+}
+
+int metrics_start(int port)
+{
+    struct sockaddr_in addr;
+    const int enable = 1;
+    int rc;
+
+    metrics_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (metrics_fd < 0)
+    {
+        LOGGER(LOG_ERR, "Error creating metrics socket: %s", strerror(errno));
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (setsockopt(metrics_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) < 0 ||
+        bind(metrics_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        listen(metrics_fd, SOMAXCONN) != 0)
+    {
+        LOGGER(LOG_ERR, "Could not listen for metrics on port %d: %s", port, strerror(errno));
+        close(metrics_fd);
+        metrics_fd = -1;
+        return -1;
+    }
+    metrics_stopping = false;
+    if ((rc = pthread_create(&metrics_thread, NULL, metrics_main, NULL)) != 0)
+    {
+        LOGGER(LOG_ERR, "Could not create metrics thread: %d", rc);
+        close(metrics_fd);
+        metrics_fd = -1;
+        return -1;
+    }
+    LOGGER(LOG_INFO, "Serving metrics on 127.0.0.1:%d", port);
+    return 0;
+}
+
+void metrics_stop(void)
+{
+    if (metrics_fd < 0)
+    {
+        return;
+    }
+    __atomic_store_n(&metrics_stopping, true, __ATOMIC_RELEASE);
+    pthread_join(metrics_thread, NULL);
+    close(metrics_fd);
+    metrics_fd = -1;
+}
@@ -0,0 +1,128 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Counters and latency histograms of the server stages. Every thread updates
+ * its own shard with plain stores, a reader sums all shards, so updating never
+ * takes a lock or bounces a cache line between threads. Shards of threads that
+ * exited are adopted by new threads and keep their counts.
+ * Histograms are log-linear like HDR histograms: values below 16 have their
+ * own bucket, above that every power of two is split into 16 buckets, so
+ * percentiles are accurate to about 6%.
+ * Gauges such as active connections and queue depths are reported as the
+ * difference of two counters.
+ */
+enum metrics_counter {
+    METRICS_ACCEPTED,
+    METRICS_CLOSED,
+    METRICS_BYTES_IN,
+    METRICS_PACKETS,
+    METRICS_APPENDS,
+    METRICS_REPLIES,
+    METRICS_REPLY_BYTES,
+    METRICS_SUBSCRIBED,
+    METRICS_UNSUBSCRIBED,
+    METRICS_QUEUED,         // pool accept queue
+    METRICS_DEQUEUED,
+    METRICS_REJECTED,
+    METRICS_SHED,
+    METRICS_SUBMITTED,      // store writer queue
+    METRICS_COMMITTED,
+    METRICS_BATCHES,
+    METRICS_SYNCS,
+    METRICS_COUNTERS,
+};
+
+enum metrics_hist {
+    METRICS_FIRST_BYTE,     // accept to first byte received
+    METRICS_ASSEMBLY,       // first byte of a packet to its newline
+    METRICS_APPEND,         // packet handed to the writer to written
+    METRICS_REPLY,          // first to last byte of a reply sent
+    METRICS_WRITE,          // writer batch written and indexed
+    METRICS_SYNC,           // data file fdatasync
+    METRICS_HISTS,
+};
+
+#define METRICS_SUB_BITS    4
+#define METRICS_BUCKETS     (64 << METRICS_SUB_BITS)
+
+/**
+ * Timestamps of one connection, owned by the thread serving it.
+ */
+typedef struct metrics_conn_s metrics_conn_t;
+struct metrics_conn_s {
+    uint64_t accepted;
+    uint64_t packet;
+    uint64_t op;
+    size_t reply_off;
+    bool received;
+};
+
+/**
+* @return a monotonic timestamp in nanoseconds.
+*/
+uint64_t metrics_now(void);
+
+void metrics_add(enum metrics_counter c, uint64_t n);
+
+void metrics_record(enum metrics_hist h, uint64_t ns);
+
+void metrics_accepted(metrics_conn_t* m);
+
+/**
+* Account for @param n bytes received, which may start the first packet.
+*/
+void metrics_received(metrics_conn_t* m, size_t n);
+
+/**
+* Account for a complete packet, @param more if bytes of the next one are
+* buffered already.
+*/
+void metrics_packet(metrics_conn_t* m, bool more);
+
+/**
+* Start timing an append, recorded by metrics_appended.
+*/
+void metrics_append_start(metrics_conn_t* m);
+
+void metrics_appended(metrics_conn_t* m);
+
+/**
+* Start timing a reply of the log from @param off, recorded by metrics_replied.
+*/
+void metrics_reply_start(metrics_conn_t* m, size_t off);
+
+/**
+* Account for a reply finished at log offset @param off.
+*/
+void metrics_replied(metrics_conn_t* m, size_t off);
+
+/**
+* Account for a reply queued at @param started and sent completely now, for
+* engines that queue replies. Their bytes are counted as they are sent.
+*/
+void metrics_reply(uint64_t started);
+
+void metrics_closed(metrics_conn_t* m);
+
+/**
+* Write all counters, gauges and histogram percentiles as text lines to
+* @param buf of @param len bytes.
+* @return the number of bytes written, without the terminating NUL.
+*/
+size_t metrics_format(char* buf, size_t len);
+
+/**
+* Serve metrics_format to every connection on 127.0.0.1:@param port from a
+* background thread.
+* @return 0 on success, -1 on error.
+*/
+int metrics_start(int port);
+
+void metrics_stop(void);
+
+#endif
@@ -0,0 +1,67 @@
+#include <string.h>
+#include "metrics.h"
+#include "outq.h"
+
+static size_t outq_high = OUTQ_DEFAULT_HIGH;
+static size_t outq_low = OUTQ_DEFAULT_LOW;
+
+void outq_limits(size_t high, size_t low)
+{
+    __atomic_store_n(&outq_high, high, __ATOMIC_RELAXED);
+    __atomic_store_n(&outq_low, (low < high) ? low : high, __ATOMIC_RELAXED);
+}
+
+void outq_init(outq_t* q)
+{
+    memset(q, 0, sizeof(outq_t));
+}
+
+void outq_push(outq_t* q, pstore_t* store, size_t off, size_t end)
+{
+    if (off >= end)
+    {
+        // nothing to send, answered right away
+        metrics_reply(metrics_now());
+        return;
+    }
+    outq_range_t* r = &q->ranges[(q->head + q->count) % OUTQ_SLOTS];
+    r->store = store;
+    r->off = off;
+    r->end = end;
+    r->queued = metrics_now();
+    q->count++;
+    q->bytes += end - off;
+}
+
+outq_range_t* outq_front(outq_t* q)
+{
+    return (q->count > 0) ? &q->ranges[q->head] : NULL;
+}
+
+void outq_sent(outq_t* q, size_t from)
+{
+    outq_range_t* r = &q->ranges[q->head];
+    // off skips past end if retention dropped the rest of the range
+    size_t to = (r->off < r->end) ? r->off : r->end;
+    q->bytes -= to - from;
+    metrics_add(METRICS_REPLY_BYTES, to - from);
+    if (to == r->end)
+    {
+        metrics_reply(r->queued);
+        q->head = (q->head + 1) % OUTQ_SLOTS;
+        q->count--;
+    }
+}
+
+bool outq_paused(outq_t* q)
+{
+    if (!q->paused)
+    {
+        q->paused = q->bytes >= __atomic_load_n(&outq_high, __ATOMIC_RELAXED) || q->count == OUTQ_SLOTS;
+    }
+    else
+    {
+        q->paused = q->bytes > __atomic_load_n(&outq_low, __ATOMIC_RELAXED) || q->count > OUTQ_SLOTS / 2;
+    }
+    return q->paused;
+}
@@ -0,0 +1,72 @@
+#ifndef OUTQ_H
+#define OUTQ_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "packet_store.h"
+
+#define OUTQ_SLOTS          32
+#define OUTQ_DEFAULT_HIGH   0x400000
+#define OUTQ_DEFAULT_LOW    0x100000
+
+/**
+ * Replies of one connection waiting to be sent, in the order their packets
+ * came in. A reply is a range of the log sent straight from the store, so a
+ * queued reply copies nothing and costs no memory beyond its slot. Every
+ * reply names its store, as packets of one connection may go to different
+ * channels.
+ * A connection keeps reading and answering packets while its earlier replies
+ * go out, until the queue holds the high watermark of bytes or all its slots.
+ * It then stops reading until the queue drained to the low watermark, which
+ * pushes back on a peer sending faster than it reads.
+ */
+typedef struct outq_range_s outq_range_t;
+struct outq_range_s {
+    pstore_t* store;
+    size_t off;
+    size_t end;
+    uint64_t queued;
+};
+
+typedef struct outq_s outq_t;
+struct outq_s {
+    outq_range_t ranges[OUTQ_SLOTS];
+    int head;
+    int count;
+    size_t bytes;
+    bool paused;
+};
+
+/**
+* Stop reading at @param high queued bytes and resume at @param low, for all
+* connections.
+*/
+void outq_limits(size_t high, size_t low);
+
+void outq_init(outq_t* q);
+
+/**
+* Queue the reply of bytes [@param off, @param end) of the log of @param store.
+* The caller checks outq_paused before answering a packet, so there is always
+* a free slot.
+*/
+void outq_push(outq_t* q, pstore_t* store, size_t off, size_t end);
+
+/**
+* @return the reply being sent, NULL if the queue is empty.
+*/
+outq_range_t* outq_front(outq_t* q);
+
+/**
+* Account for the front reply having been sent from log offset @param from up
+* to its off, dropping it once it is complete.
+*/
+void outq_sent(outq_t* q, size_t from);
+
+/**
+* @return true if the connection should not read, updated with hysteresis.
+*/
+bool outq_paused(outq_t* q);
+
+#endif
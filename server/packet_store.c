@@ -0,0 +1,1473 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "packet_store.h"
+#include "logger.h"
+#include "metrics.h"
+
+#define PSTORE_IOV_MAX      64
+#define PSTORE_REAP_MS      1000
+
+/* a mapping replaced by a larger one, unmapped once its file is not pinned */
+typedef struct pstore_map_s pstore_map_t;
+struct pstore_map_s {
+    char* base;
+    size_t len;
+    pstore_map_t* next;
+};
+
+/*
+ * A backing file, holding the log from off up to the next file. It is mapped
+ * read-only at base with room to grow to maplen, and refs counts the
+ * pstore_iov entries pointing into it.
+ */
+struct pstore_file_s {
+    size_t off;
+    time_t mtime;
+    char* base;
+    size_t maplen;
+    unsigned refs;
+    pstore_map_t* retired;
+};
+
+/* caller holds ps->lock */
+static int pstore_index(pstore_t* ps, const char* buf, size_t len, size_t base)
+{
+    const char* p = buf;
+    const char* nl;
+
+    while ((nl = memchr(p, '\n', len - (p - buf))) != NULL)
+    {
+        if (ps->npkts == ps->cappkts)
+        {
+            size_t cap = ps->cappkts ? ps->cappkts * 2 : 1024;
+            size_t* pkts = realloc(ps->pkts, cap * sizeof(size_t));
+            if (!pkts)
+            {
+                return -1;
+            }
+            ps->pkts = pkts;
+            ps->cappkts = cap;
+        }
+        ps->pkts[ps->npkts++] = base + (nl - buf) + 1;
+        p = nl + 1;
+    }
+    return 0;
+}
+
+/* caller holds ps->lock, @return the number of retained packets ending at or before @param pos */
+static size_t pstore_count(pstore_t* ps, size_t pos)
+{
+    size_t lo = 0;
+    size_t hi = ps->npkts;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (ps->pkts[mid] <= pos)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* caller holds ps->lock, @return the index of the file holding log offset @param pos */
+static size_t pstore_file_at(pstore_t* ps, size_t pos)
+{
+    size_t lo = 0;
+    size_t hi = ps->nfiles;
+    while (hi - lo > 1)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (ps->files[mid].off <= pos)
+        {
+            lo = mid;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* caller holds ps->lock */
+static int pstore_iov_locked(pstore_t* ps, size_t* off, size_t end, struct iovec* iov, int iovcnt)
+{
+    int cnt = 0;
+    if (*off < ps->start)
+    {
+        *off = ps->start;
+    }
+    if (end > ps->size)
+    {
+        end = ps->size;
+    }
+    if (*off >= end)
+    {
+        return 0;
+    }
+    if (ps->ring)
+    {
+        // the second mapping continues the first, a range never wraps
+        iov[0].iov_base = ps->ring + *off % ps->ring_cap;
+        iov[0].iov_len = end - *off;
+        ps->ring_pins[pstore_count(ps, *off)]++;
+        return 1;
+    }
+    for (size_t i = pstore_file_at(ps, *off), pos = *off; pos < end && cnt < iovcnt; i++, cnt++)
+    {
+        pstore_file_t* f = &ps->files[i];
+        size_t n = ((i + 1 < ps->nfiles) ? ps->files[i + 1].off : ps->size) - pos;
+        if (n > end - pos)
+        {
+            n = end - pos;
+        }
+        f->refs++;
+        iov[cnt].iov_base = f->base + (pos - f->off);
+        iov[cnt].iov_len = n;
+        pos += n;
+    }
+    return cnt;
+}
+
+/* the first file keeps the bare path, so it reads like the single data file it used to be */
+static void pstore_name(const char* path, size_t off, char* buf, size_t len)
+{
+    if (off == 0)
+    {
+        snprintf(buf, len, "%s", path);
+    }
+    else
+    {
+        snprintf(buf, len, "%s.%016zx", path, off);
+    }
+}
+
+static int pstore_cmp(const void* a, const void* b)
+{
+    size_t x = *(const size_t*)a;
+    size_t y = *(const size_t*)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Collect the offsets of the backing files of @param path in *@param offs,
+ * sorted, which the caller frees.
+ * @return the number of files, -1 on error.
+ */
+static ssize_t pstore_scan(const char* path, size_t** offs)
+{
+    char dir[PATH_MAX];
+    const char* base = strrchr(path, '/');
+    if (base)
+    {
+        snprintf(dir, sizeof(dir), "%.*s", (int)(base - path) + 1, path);
+        base++;
+    }
+    else
+    {
+        strcpy(dir, ".");
+        base = path;
+    }
+    size_t blen = strlen(base);
+
+    DIR* d = opendir(dir);
+    if (!d)
+    {
+        LOGGER(LOG_ERR, "Could not open data directory %s: %s", dir, strerror(errno));
+        return -1;
+    }
+    size_t n = 0;
+    size_t cap = 0;
+    *offs = NULL;
+    struct dirent* de;
+    while ((de = readdir(d)) != NULL)
+    {
+        const char* hex = de->d_name + blen + 1;
+        char* e;
+        size_t off = 0;
+        if (strcmp(de->d_name, base) != 0)
+        {
+            if (strncmp(de->d_name, base, blen) != 0 || de->d_name[blen] != '.' ||
+                strlen(hex) != 16)
+            {
+                continue;
+            }
+            off = strtoull(hex, &e, 16);
+            // offset 0 is the bare path, never a suffixed name
+            if (*e != '\0' || off == 0)
+            {
+                continue;
+            }
+        }
+        if (n == cap)
+        {
+            cap = cap ? cap * 2 : 16;
+            size_t* grown = realloc(*offs, cap * sizeof(size_t));
+            if (!grown)
+            {
+                LOGGER(LOG_ERR, "Could not allocate memory for data file list");
+                closedir(d);
+                free(*offs);
+                *offs = NULL;
+                return -1;
+            }
+            *offs = grown;
+        }
+        (*offs)[n++] = off;
+    }
+    closedir(d);
+    qsort(*offs, n, sizeof(size_t), pstore_cmp);
+    return n;
+}
+
+/* round the mapping of a file of @param len bytes up to leave at least a file worth of room */
+static size_t pstore_map_len(size_t len)
+{
+    return (len / PSTORE_FILE_SIZE + 2) * PSTORE_FILE_SIZE;
+}
+
+/* caller holds ps->lock, or is the only thread using the store */
+static int pstore_add_file(pstore_t* ps, size_t off, time_t mtime, char* base, size_t maplen)
+{
+    if (ps->nfiles == ps->capfiles)
+    {
+        size_t cap = ps->capfiles ? ps->capfiles * 2 : 16;
+        pstore_file_t* files = realloc(ps->files, cap * sizeof(pstore_file_t));
+        if (!files)
+        {
+            return -1;
+        }
+        ps->files = files;
+        ps->capfiles = cap;
+    }
+    pstore_file_t* f = &ps->files[ps->nfiles++];
+    memset(f, 0, sizeof(pstore_file_t));
+    f->off = off;
+    f->mtime = mtime;
+    f->base = base;
+    f->maplen = maplen;
+    return 0;
+}
+
+/* caller holds ps->lock, unmaps the file and any mapping it outgrew */
+static void pstore_unmap(pstore_file_t* f)
+{
+    while (f->retired)
+    {
+        pstore_map_t* map = f->retired;
+        f->retired = map->next;
+        munmap(map->base, map->len);
+        free(map);
+    }
+    if (f->base)
+    {
+        munmap(f->base, f->maplen);
+        f->base = NULL;
+    }
+}
+
+/**
+ * Open the backing file starting at log offset @param off for appending, or an
+ * anonymous one for a store without a path, and map it read-only.
+ * @return the descriptor, -1 on error.
+ */
+static int pstore_open(pstore_t* ps, size_t off, char** base, size_t* maplen)
+{
+    char name[PATH_MAX];
+    int fd;
+    if (ps->path)
+    {
+        pstore_name(ps->path, off, name, sizeof(name));
+        fd = open(name, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    }
+    else
+    {
+        strcpy(name, "memfd");
+        fd = memfd_create("aesdsocketdata", MFD_CLOEXEC);
+    }
+    if (fd < 0)
+    {
+        LOGGER(LOG_ERR, "Could not open data file %s: %s", name, strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        LOGGER(LOG_ERR, "Could not stat data file %s: %s", name, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    *maplen = pstore_map_len(st.st_size);
+    *base = mmap(NULL, *maplen, PROT_READ, MAP_SHARED, fd, 0);
+    if (*base == MAP_FAILED)
+    {
+        LOGGER(LOG_ERR, "Could not map data file %s: %s", name, strerror(errno));
+        *base = NULL;
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* the realtime deadline @param ms milliseconds from now in @param ts, for condition waits */
+static void pstore_deadline(struct timespec* ts, int ms)
+{
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (ms % 1000) * 1000000L;
+    if (ts->tv_nsec >= 1000000000L)
+    {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+/*
+ * Flush the current file to disk. Only the writer thread touches ps->fd and
+ * the dirty state.
+ * @return 0 on success, -1 on error.
+ */
+static int pstore_sync(pstore_t* ps)
+{
+    uint64_t started = metrics_now();
+    int rc = fdatasync(ps->fd);
+    metrics_record(METRICS_SYNC, metrics_now() - started);
+    metrics_add(METRICS_SYNCS, 1);
+    ps->dirty = false;
+    if (rc != 0)
+    {
+        LOGGER(LOG_ERR, "Could not sync data file: %s", strerror(errno));
+    }
+    return rc;
+}
+
+/*
+ * @return the milliseconds until the written batches are due to be synced,
+ * 0 if they are due now, -1 if nothing waits for a sync.
+ */
+static int pstore_sync_wait(pstore_t* ps)
+{
+    if (!ps->dirty)
+    {
+        return -1;
+    }
+    uint64_t age = (metrics_now() - ps->dirty_since) / 1000000;
+    return (age >= (uint64_t)ps->sync_ms) ? 0 : ps->sync_ms - (int)age;
+}
+
+/* make a file just created in the directory of the store survive a crash */
+static void pstore_sync_dir(pstore_t* ps)
+{
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", ps->path);
+    char* slash = strrchr(dir, '/');
+    if (!slash)
+    {
+        strcpy(dir, ".");
+    }
+    else
+    {
+        slash[slash == dir ? 1 : 0] = '\0';
+    }
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0 || fsync(fd) != 0)
+    {
+        LOGGER(LOG_ERR, "Could not sync data directory %s: %s", dir, strerror(errno));
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+}
+
+/* take everything queued so far, oldest first */
+static pstore_req_t* pstore_take(pstore_t* ps)
+{
+    pstore_req_t* req = __atomic_exchange_n(&ps->pending, NULL, __ATOMIC_ACQUIRE);
+    pstore_req_t* batch = NULL;
+    while (req)
+    {
+        pstore_req_t* next = req->next;
+        req->next = batch;
+        batch = req;
+        req = next;
+    }
+    return batch;
+}
+
+/* write the packets of @param req and the requests after it straight from their buffers, 64 per writev */
+static int pstore_write(pstore_t* ps, pstore_req_t* req)
+{
+    struct iovec iov[PSTORE_IOV_MAX];
+    size_t done = 0;
+
+    for (;;)
+    {
+        int cnt = 0;
+        size_t skip = done;
+        for (pstore_req_t* r = req; r && cnt < PSTORE_IOV_MAX; r = r->next)
+        {
+            if (r->len > skip)
+            {
+                iov[cnt].iov_base = (char*)r->buf + skip;
+                iov[cnt].iov_len = r->len - skip;
+                cnt++;
+            }
+            skip = 0;
+        }
+        if (cnt == 0)
+        {
+            return 0;
+        }
+        ssize_t sz = writev(ps->fd, iov, cnt);
+        if (sz < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            LOGGER(LOG_ERR, "Could not write to data file: %s", strerror(errno));
+            return -1;
+        }
+        done += sz;
+        while (req && done >= req->len)
+        {
+            done -= req->len;
+            req = req->next;
+        }
+    }
+}
+
+/*
+ * Write the batch to the current file and map what it grew to. The new bytes
+ * are only indexed and made visible once they are in the file, a batch that
+ * fails is cut off again so appends stay all or nothing.
+ * @return 0 on success, -1 on error.
+ */
+static int pstore_commit(pstore_t* ps, pstore_req_t* batch)
+{
+    pthread_mutex_lock(&ps->lock);
+    pstore_file_t* f = &ps->files[ps->nfiles - 1];
+    size_t off = f->off;
+    size_t size = ps->size;
+    size_t maplen = f->maplen;
+    pthread_mutex_unlock(&ps->lock);
+
+    size_t end = size;
+    for (pstore_req_t* req = batch; req; req = req->next)
+    {
+        end += req->len;
+    }
+    if (end == size)
+    {
+        return 0;
+    }
+
+    // only the writer thread appends, so the file and the mapping stay put
+    pstore_map_t* old = NULL;
+    char* base = NULL;
+    if (pstore_write(ps, batch) != 0)
+    {
+        goto error;
+    }
+    if (ps->sync == PSTORE_SYNC_ALWAYS && pstore_sync(ps) != 0)
+    {
+        goto error;
+    }
+    if (end - off > maplen)
+    {
+        old = malloc(sizeof(pstore_map_t));
+        maplen = pstore_map_len(end - off);
+        base = mmap(NULL, maplen, PROT_READ, MAP_SHARED, ps->fd, 0);
+        if (!old || base == MAP_FAILED)
+        {
+            LOGGER(LOG_ERR, "Could not map %zu bytes of data file", maplen);
+            base = NULL;
+            goto error;
+        }
+    }
+
+    pthread_mutex_lock(&ps->lock);
+    size_t npkts = ps->npkts;
+    f = &ps->files[ps->nfiles - 1];
+    if (base)
+    {
+        old->base = f->base;
+        old->len = f->maplen;
+        old->next = f->retired;
+        f->retired = old;
+        f->base = base;
+        f->maplen = maplen;
+    }
+    if (pstore_index(ps, f->base + (size - off), end - size, size) != 0)
+    {
+        LOGGER(LOG_ERR, "Could not allocate memory for the packet index");
+        ps->npkts = npkts;
+        pthread_mutex_unlock(&ps->lock);
+        if (ftruncate(ps->fd, size - off) != 0)
+        {
+            LOGGER(LOG_ERR, "Could not cut off failed batch: %s", strerror(errno));
+        }
+        return -1;
+    }
+    // last, readers that load it without the lock find the index and mapping in place
+    __atomic_store_n(&ps->size, end, __ATOMIC_RELEASE);
+    f->mtime = time(NULL);
+    pthread_mutex_unlock(&ps->lock);
+    return 0;
+
+error:
+    free(old);
+    if (base)
+    {
+        munmap(base, maplen);
+    }
+    if (ftruncate(ps->fd, size - off) != 0)
+    {
+        LOGGER(LOG_ERR, "Could not cut off failed batch: %s", strerror(errno));
+    }
+    return -1;
+}
+
+/*
+ * Copy the batch into the ring one packet at a time, first dropping the oldest
+ * packets until the new one fits both limits and waiting for the readers still
+ * sending from them. A packet longer than the ring fails on its own.
+ */
+static void pstore_ring_commit(pstore_t* ps, pstore_req_t* batch)
+{
+    for (pstore_req_t* req = batch; req; req = req->next)
+    {
+        if (req->len > ps->ring_cap)
+        {
+            LOGGER(LOG_ERR, "Packet of %zu bytes does not fit the ring of %zu", req->len, ps->ring_cap);
+            req->rc = -1;
+            continue;
+        }
+        if (req->len == 0)
+        {
+            continue;
+        }
+        bool terminated = req->buf[req->len - 1] == '\n';
+
+        pthread_mutex_lock(&ps->lock);
+        size_t size = ps->size;
+        size_t end = size + req->len;
+        size_t drop = 0;
+        size_t start = ps->start;
+        while (drop < ps->npkts &&
+               (end - start > ps->ring_cap || ps->npkts - drop + terminated > ps->ring_pkts))
+        {
+            ps->ring_stale += ps->ring_pins[drop];
+            start = ps->pkts[drop++];
+        }
+        size_t keep = ps->npkts - drop;
+        if (end - start > ps->ring_cap)
+        {
+            // only an unterminated packet is left, it goes too
+            ps->ring_stale += ps->ring_pins[drop];
+            ps->ring_pins[drop] = 0;
+            start = size;
+        }
+        // the pins of the unterminated tail move along at index keep
+        memmove(ps->pkts, ps->pkts + drop, keep * sizeof(size_t));
+        memmove(ps->ring_pins, ps->ring_pins + drop, (keep + 1) * sizeof(unsigned));
+        memset(ps->ring_pins + keep + 1, 0, drop * sizeof(unsigned));
+        ps->npkts = keep;
+        ps->start = start;
+        while (ps->ring_stale > 0)
+        {
+            pthread_cond_wait(&ps->unpinned, &ps->lock);
+        }
+        memcpy(ps->ring + size % ps->ring_cap, req->buf, req->len);
+        if (terminated)
+        {
+            ps->pkts[ps->npkts++] = end;
+        }
+        __atomic_store_n(&ps->size, end, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&ps->lock);
+    }
+}
+
+/*
+ * Move on to a new backing file once the current one is full and the log ends
+ * on a packet boundary, so files always start with a whole packet. Without
+ * retention limits nothing is ever dropped, so the log stays in the one file
+ * at the bare path. Only the writer thread touches ps->fd.
+ */
+static void pstore_rotate(pstore_t* ps)
+{
+    pthread_mutex_lock(&ps->lock);
+    size_t off = ps->size;
+    bool full = (ps->retain_bytes || ps->retain_pkts || ps->retain_age) &&
+                off - ps->files[ps->nfiles - 1].off >= PSTORE_FILE_SIZE &&
+                ps->npkts > 0 && ps->pkts[ps->npkts - 1] == off;
+    pthread_mutex_unlock(&ps->lock);
+    if (!full)
+    {
+        return;
+    }
+
+    char* base;
+    size_t maplen;
+    int fd = pstore_open(ps, off, &base, &maplen);
+    if (fd < 0)
+    {
+        // keep appending to the full file rather than lose packets
+        return;
+    }
+    pthread_mutex_lock(&ps->lock);
+    if (pstore_add_file(ps, off, time(NULL), base, maplen) != 0)
+    {
+        pthread_mutex_unlock(&ps->lock);
+        LOGGER(LOG_ERR, "Could not allocate memory for data file list");
+        munmap(base, maplen);
+        close(fd);
+        if (ps->path)
+        {
+            char name[PATH_MAX];
+            pstore_name(ps->path, off, name, sizeof(name));
+            unlink(name);
+        }
+        return;
+    }
+    pthread_cond_signal(&ps->reap);
+    pthread_mutex_unlock(&ps->lock);
+    if (ps->dirty)
+    {
+        pstore_sync(ps);
+    }
+    close(ps->fd);
+    ps->fd = fd;
+    if (ps->path && ps->sync >= PSTORE_SYNC_INTERVAL)
+    {
+        pstore_sync_dir(ps);
+    }
+}
+
+static void* pstore_writer(void* arg)
+{
+    pstore_t* ps = (pstore_t*)arg;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&ps->lock);
+        int wait;
+        while (!ps->stop && !__atomic_load_n(&ps->pending, __ATOMIC_ACQUIRE) &&
+               (wait = pstore_sync_wait(ps)) != 0)
+        {
+            if (wait < 0)
+            {
+                pthread_cond_wait(&ps->cond, &ps->lock);
+                continue;
+            }
+            struct timespec ts;
+            pstore_deadline(&ts, wait);
+            pthread_cond_timedwait(&ps->cond, &ps->lock, &ts);
+        }
+        bool stop = ps->stop;
+        pstore_req_t* batch = pstore_take(ps);
+        pthread_mutex_unlock(&ps->lock);
+        if (!batch)
+        {
+            if (ps->dirty)
+            {
+                // the interval passed, or stopping with nothing left to write
+                pstore_sync(ps);
+            }
+            if (stop)
+            {
+                break;
+            }
+            continue;
+        }
+
+        uint64_t started = metrics_now();
+        int rc = 0;
+        if (ps->ring)
+        {
+            pstore_ring_commit(ps, batch);
+        }
+        else
+        {
+            rc = pstore_commit(ps, batch);
+            if (rc == 0 && ps->sync == PSTORE_SYNC_INTERVAL && !ps->dirty)
+            {
+                ps->dirty = true;
+                ps->dirty_since = started;
+            }
+            if (rc == 0)
+            {
+                pstore_rotate(ps);
+            }
+        }
+        metrics_record(METRICS_WRITE, metrics_now() - started);
+        metrics_add(METRICS_BATCHES, 1);
+
+        // waiters own their request again as soon as done is set
+        pstore_req_t* async = NULL;
+        pthread_mutex_lock(&ps->lock);
+        size_t end = ps->size;
+        uint64_t cnt = 0;
+        while (batch)
+        {
+            cnt++;
+            pstore_req_t* req = batch;
+            batch = req->next;
+            req->end = end;
+            if (rc != 0)
+            {
+                req->rc = rc;
+            }
+            if (req->complete)
+            {
+                req->next = async;
+                async = req;
+            }
+            else
+            {
+                req->done = true;
+            }
+        }
+        metrics_add(METRICS_COMMITTED, cnt);
+        pthread_cond_broadcast(&ps->committed);
+        for (pstore_watch_t* watch = ps->watches; watch; watch = watch->next)
+        {
+            watch->notify(watch);
+        }
+        pthread_mutex_unlock(&ps->lock);
+
+        while (async)
+        {
+            pstore_req_t* req = async;
+            async = req->next;
+            req->complete(req);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Drop the oldest retained backing file if the retention limits say so: the
+ * log now starts at the next file, and the packets before it go. Dropped
+ * files stay mapped until no reader pins them, and are unmapped on a later
+ * pass once that is so.
+ * Caller holds ps->lock, which is released while a file is unlinked.
+ * @return true if a file was dropped.
+ */
+static bool pstore_trim(pstore_t* ps)
+{
+    size_t first = pstore_file_at(ps, ps->start);
+    size_t next = (first + 1 < ps->nfiles) ? ps->files[first + 1].off : 0;
+    bool drop = first + 1 < ps->nfiles &&
+        ((ps->retain_bytes && ps->size - next >= ps->retain_bytes) ||
+         (ps->retain_pkts && ps->npkts - pstore_count(ps, next) >= ps->retain_pkts) ||
+         (ps->retain_age && ps->files[first].mtime + ps->retain_age <= time(NULL)));
+    size_t dropped = ps->files[first].off;
+
+    if (drop)
+    {
+        size_t n = pstore_count(ps, next);
+        memmove(ps->pkts, ps->pkts + n, (ps->npkts - n) * sizeof(size_t));
+        ps->npkts -= n;
+        ps->start = next;
+        first++;
+    }
+
+    size_t unmapped = 0;
+    while (unmapped < first && ps->files[unmapped].refs == 0)
+    {
+        pstore_unmap(&ps->files[unmapped++]);
+    }
+    if (unmapped > 0)
+    {
+        memmove(ps->files, ps->files + unmapped, (ps->nfiles - unmapped) * sizeof(pstore_file_t));
+        ps->nfiles -= unmapped;
+    }
+    for (size_t i = 0; i < ps->nfiles; i++)
+    {
+        if (ps->files[i].retired && ps->files[i].refs == 0)
+        {
+            pstore_map_t* map = ps->files[i].retired;
+            ps->files[i].retired = NULL;
+            while (map)
+            {
+                pstore_map_t* next_map = map->next;
+                munmap(map->base, map->len);
+                free(map);
+                map = next_map;
+            }
+        }
+    }
+
+    if (!drop)
+    {
+        return false;
+    }
+    pthread_mutex_unlock(&ps->lock);
+    LOGGER(LOG_INFO, "Dropping data file at offset %zu, log now starts at %zu", dropped, next);
+    if (ps->path)
+    {
+        char name[PATH_MAX];
+        pstore_name(ps->path, dropped, name, sizeof(name));
+        if (unlink(name) != 0)
+        {
+            LOGGER(LOG_ERR, "Could not remove data file %s: %s", name, strerror(errno));
+        }
+    }
+    pthread_mutex_lock(&ps->lock);
+    return true;
+}
+
+/* enforces retention in the background, woken by rotations and once a second for age */
+static void* pstore_reaper(void* arg)
+{
+    pstore_t* ps = (pstore_t*)arg;
+
+    pthread_mutex_lock(&ps->lock);
+    while (!ps->stop)
+    {
+        while (pstore_trim(ps) && !ps->stop)
+            ;
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += PSTORE_REAP_MS / 1000;
+        if (!ps->stop)
+        {
+            pthread_cond_timedwait(&ps->reap, &ps->lock, &ts);
+        }
+    }
+    pthread_mutex_unlock(&ps->lock);
+    return NULL;
+}
+
+/* map the backing file starting at log offset @param off and index its packets in place */
+static int pstore_load_file(pstore_t* ps, size_t off)
+{
+    char name[PATH_MAX];
+    pstore_name(ps->path, off, name, sizeof(name));
+    int fd = open(name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        LOGGER(LOG_ERR, "Could not open data file %s: %s", name, strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        LOGGER(LOG_ERR, "Could not stat data file %s: %s", name, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    size_t maplen = pstore_map_len(st.st_size);
+    char* base = mmap(NULL, maplen, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+    {
+        LOGGER(LOG_ERR, "Could not map data file %s: %s", name, strerror(errno));
+        return -1;
+    }
+    if (pstore_add_file(ps, off, st.st_mtime, base, maplen) != 0)
+    {
+        LOGGER(LOG_ERR, "Could not allocate memory for data file list");
+        munmap(base, maplen);
+        return -1;
+    }
+    if (pstore_index(ps, base, st.st_size, off) != 0)
+    {
+        LOGGER(LOG_ERR, "Could not allocate memory for the packet index");
+        return -1;
+    }
+    ps->size = off + st.st_size;
+    return 0;
+}
+
+/*
+ * Load the files a previous run left and open the newest for appending. Files
+ * that do not continue the log where the one before ended are removed.
+ */
+static int pstore_load(pstore_t* ps)
+{
+    size_t* offs;
+    ssize_t n = pstore_scan(ps->path, &offs);
+    if (n < 0)
+    {
+        return -1;
+    }
+    for (ssize_t i = 0; i < n; i++)
+    {
+        if (i == 0)
+        {
+            ps->start = ps->size = offs[i];
+        }
+        else if (offs[i] != ps->size)
+        {
+            char name[PATH_MAX];
+            pstore_name(ps->path, offs[i], name, sizeof(name));
+            LOGGER(LOG_ERR, "Removing data file %s, the log ended at %zu", name, ps->size);
+            unlink(name);
+            continue;
+        }
+        if (pstore_load_file(ps, offs[i]) != 0)
+        {
+            free(offs);
+            return -1;
+        }
+    }
+    free(offs);
+    return 0;
+}
+
+/* the newest file is reopened for appending, or a first one created */
+static int pstore_open_last(pstore_t* ps)
+{
+    char* base;
+    size_t maplen;
+    size_t off = ps->nfiles ? ps->files[ps->nfiles - 1].off : ps->size;
+    ps->fd = pstore_open(ps, off, &base, &maplen);
+    if (ps->fd < 0)
+    {
+        return -1;
+    }
+    if (ps->nfiles)
+    {
+        // same file, so the mapping made at load time is kept
+        munmap(base, maplen);
+        return 0;
+    }
+    if (pstore_add_file(ps, off, time(NULL), base, maplen) != 0)
+    {
+        LOGGER(LOG_ERR, "Could not allocate memory for data file list");
+        munmap(base, maplen);
+        return -1;
+    }
+    return 0;
+}
+
+static void pstore_release(pstore_t* ps)
+{
+    if (ps->fd >= 0)
+    {
+        close(ps->fd);
+        ps->fd = -1;
+    }
+    for (size_t i = 0; i < ps->nfiles; i++)
+    {
+        pstore_unmap(&ps->files[i]);
+    }
+    if (ps->ring)
+    {
+        munmap(ps->ring, 2 * ps->ring_cap);
+        ps->ring = NULL;
+    }
+    free(ps->files);
+    ps->files = NULL;
+    ps->nfiles = 0;
+    ps->capfiles = 0;
+    free(ps->path);
+    ps->path = NULL;
+    free(ps->pkts);
+    ps->pkts = NULL;
+    free(ps->ring_pins);
+    ps->ring_pins = NULL;
+    ps->npkts = 0;
+    ps->cappkts = 0;
+    ps->size = 0;
+    pthread_cond_destroy(&ps->unpinned);
+    pthread_cond_destroy(&ps->reap);
+    pthread_cond_destroy(&ps->committed);
+    pthread_cond_destroy(&ps->cond);
+    pthread_mutex_destroy(&ps->lock);
+}
+
+/* set up the lock and conditions of a zeroed store */
+static int pstore_init_sync(pstore_t* ps)
+{
+    int rc;
+
+    if ((rc = pthread_mutex_init(&ps->lock, NULL)) != 0)
+    {
+        LOGGER(LOG_ERR, "Failed to initialize store mutex: %d", rc);
+        return -1;
+    }
+    if ((rc = pthread_cond_init(&ps->cond, NULL)) != 0)
+    {
+        LOGGER(LOG_ERR, "Failed to initialize store condition: %d", rc);
+        pthread_mutex_destroy(&ps->lock);
+        return -1;
+    }
+    if ((rc = pthread_cond_init(&ps->committed, NULL)) != 0)
+    {
+        LOGGER(LOG_ERR, "Failed to initialize store condition: %d", rc);
+        pthread_cond_destroy(&ps->cond);
+        pthread_mutex_destroy(&ps->lock);
+        return -1;
+    }
+    if ((rc = pthread_cond_init(&ps->reap, NULL)) != 0)
+    {
+        LOGGER(LOG_ERR, "Failed to initialize store condition: %d", rc);
+        pthread_cond_destroy(&ps->committed);
+        pthread_cond_destroy(&ps->cond);
+        pthread_mutex_destroy(&ps->lock);
+        return -1;
+    }
+    if ((rc = pthread_cond_init(&ps->unpinned, NULL)) != 0)
+    {
+        LOGGER(LOG_ERR, "Failed to initialize store condition: %d", rc);
+        pthread_cond_destroy(&ps->reap);
+        pthread_cond_destroy(&ps->committed);
+        pthread_cond_destroy(&ps->cond);
+        pthread_mutex_destroy(&ps->lock);
+        return -1;
+    }
+    return 0;
+}
+
+/* start the writer, and the reaper for a store of files, releasing the store on error */
+static int pstore_spawn(pstore_t* ps)
+{
+    int rc;
+
+    if ((rc = pthread_create(&ps->writer, NULL, pstore_writer, ps)) != 0)
+    {
+        LOGGER(LOG_ERR, "Could not create writer thread: %d", rc);
+        pstore_release(ps);
+        return -1;
+    }
+    if (!ps->ring && (rc = pthread_create(&ps->reaper, NULL, pstore_reaper, ps)) != 0)
+    {
+        LOGGER(LOG_ERR, "Could not create reaper thread: %d", rc);
+        pthread_mutex_lock(&ps->lock);
+        ps->stop = true;
+        pthread_cond_signal(&ps->cond);
+        pthread_mutex_unlock(&ps->lock);
+        pthread_join(ps->writer, NULL);
+        pstore_release(ps);
+        return -1;
+    }
+    return 0;
+}
+
+int pstore_init(pstore_t* ps, const char* path)
+{
+    memset(ps, 0, sizeof(pstore_t));
+    ps->fd = -1;
+    ps->sync = path ? PSTORE_SYNC_BUFFERED : PSTORE_SYNC_MEMORY;
+    if (pstore_init_sync(ps) != 0)
+    {
+        return -1;
+    }
+
+    if (path)
+    {
+        ps->path = strdup(path);
+        if (!ps->path || pstore_load(ps) != 0)
+        {
+            pstore_release(ps);
+            return -1;
+        }
+    }
+    if (pstore_open_last(ps) != 0)
+    {
+        pstore_release(ps);
+        return -1;
+    }
+    return pstore_spawn(ps);
+}
+
+int pstore_init_ring(pstore_t* ps, size_t packets, size_t bytes)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    size_t cap = (bytes + page - 1) / page * page;
+
+    memset(ps, 0, sizeof(pstore_t));
+    ps->fd = -1;
+    ps->sync = PSTORE_SYNC_MEMORY;
+    if (packets == 0 || cap == 0 || pstore_init_sync(ps) != 0)
+    {
+        return -1;
+    }
+    // one pin count per packet, and one for the unterminated tail
+    ps->pkts = malloc(packets * sizeof(size_t));
+    ps->ring_pins = calloc(packets + 1, sizeof(unsigned));
+    if (!ps->pkts || !ps->ring_pins)
+    {
+        LOGGER(LOG_ERR, "Could not allocate index of %zu packets", packets);
+        pstore_release(ps);
+        return -1;
+    }
+    ps->cappkts = packets;
+    ps->ring_pkts = packets;
+
+    // reserve room for both mappings first, so they are sure to be adjacent
+    int fd = memfd_create("aesdsocketring", MFD_CLOEXEC);
+    char* base = mmap(NULL, 2 * cap, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (fd < 0 || base == MAP_FAILED || ftruncate(fd, cap) != 0 ||
+        mmap(base, cap, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+        mmap(base + cap, cap, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)
+    {
+        LOGGER(LOG_ERR, "Could not map ring of %zu bytes: %s", cap, strerror(errno));
+        if (base != MAP_FAILED)
+        {
+            munmap(base, 2 * cap);
+        }
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        pstore_release(ps);
+        return -1;
+    }
+    close(fd);
+    // fault every page in now rather than on the first lap
+    memset(base, 0, cap);
+    ps->ring = base;
+    ps->ring_cap = cap;
+    LOGGER(LOG_INFO, "Keeping the last %zu packets in a ring of %zu bytes", packets, cap);
+    return pstore_spawn(ps);
+}
+
+void pstore_destroy(pstore_t* ps)
+{
+    pthread_mutex_lock(&ps->lock);
+    ps->stop = true;
+    pthread_cond_signal(&ps->cond);
+    pthread_cond_signal(&ps->reap);
+    pthread_mutex_unlock(&ps->lock);
+    pthread_join(ps->writer, NULL);
+    if (!ps->ring)
+    {
+        pthread_join(ps->reaper, NULL);
+    }
+    // the writer drained every submitted request before it stopped
+    if (ps->fd >= 0 && fdatasync(ps->fd) != 0)
+    {
+        LOGGER(LOG_ERR, "Could not flush data file: %s", strerror(errno));
+    }
+    pstore_release(ps);
+}
+
+void pstore_remove(const char* path)
+{
+    size_t* offs;
+    ssize_t n = pstore_scan(path, &offs);
+    for (ssize_t i = 0; i < n; i++)
+    {
+        char name[PATH_MAX];
+        pstore_name(path, offs[i], name, sizeof(name));
+        unlink(name);
+    }
+    if (n >= 0)
+    {
+        free(offs);
+    }
+}
+
+void pstore_retain(pstore_t* ps, size_t bytes, size_t packets, time_t age)
+{
+    pthread_mutex_lock(&ps->lock);
+    ps->retain_bytes = bytes;
+    ps->retain_pkts = packets;
+    ps->retain_age = age;
+    pthread_cond_signal(&ps->reap);
+    pthread_mutex_unlock(&ps->lock);
+}
+
+void pstore_durability(pstore_t* ps, enum pstore_sync mode, int interval_ms)
+{
+    pthread_mutex_lock(&ps->lock);
+    ps->sync = mode;
+    ps->sync_ms = interval_ms;
+    pthread_mutex_unlock(&ps->lock);
+    if (ps->path && mode >= PSTORE_SYNC_INTERVAL)
+    {
+        // the file opened at start up may be new
+        pstore_sync_dir(ps);
+    }
+}
+
+void pstore_submit(pstore_t* ps, pstore_req_t* req)
+{
+    req->rc = 0;
+    req->done = false;
+    metrics_add(METRICS_SUBMITTED, 1);
+    pstore_req_t* head = __atomic_load_n(&ps->pending, __ATOMIC_RELAXED);
+    do
+    {
+        req->next = head;
+    } while (!__atomic_compare_exchange_n(&ps->pending, &head, req, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    if (!head)
+    {
+        // the writer may be asleep, anything pushed after us rides along
+        pthread_mutex_lock(&ps->lock);
+        pthread_cond_signal(&ps->cond);
+        pthread_mutex_unlock(&ps->lock);
+    }
+}
+
+int pstore_append(pstore_t* ps, const char* buf, size_t len)
+{
+    pstore_req_t req;
+
+    memset(&req, 0, sizeof(req));
+    req.buf = buf;
+    req.len = len;
+    pstore_submit(ps, &req);
+
+    pthread_mutex_lock(&ps->lock);
+    while (!req.done)
+    {
+        pthread_cond_wait(&ps->committed, &ps->lock);
+    }
+    pthread_mutex_unlock(&ps->lock);
+    return req.rc;
+}
+
+size_t pstore_size(pstore_t* ps)
+{
+    return __atomic_load_n(&ps->size, __ATOMIC_ACQUIRE);
+}
+
+size_t pstore_start(pstore_t* ps)
+{
+    pthread_mutex_lock(&ps->lock);
+    size_t start = ps->start;
+    pthread_mutex_unlock(&ps->lock);
+    return start;
+}
+
+size_t pstore_wait(pstore_t* ps, size_t off, int ms)
+{
+    struct timespec ts;
+    size_t size = pstore_size(ps);
+
+    if (size > off)
+    {
+        // a follower that is behind never touches the lock
+        return size;
+    }
+    pstore_deadline(&ts, ms);
+    pthread_mutex_lock(&ps->lock);
+    while (ps->size <= off && !ps->interrupted)
+    {
+        if (pthread_cond_timedwait(&ps->committed, &ps->lock, &ts) == ETIMEDOUT)
+        {
+            break;
+        }
+    }
+    size = ps->size;
+    pthread_mutex_unlock(&ps->lock);
+    return size;
+}
+
+void pstore_interrupt(pstore_t* ps)
+{
+    pthread_mutex_lock(&ps->lock);
+    ps->interrupted = true;
+    pthread_cond_broadcast(&ps->committed);
+    pthread_mutex_unlock(&ps->lock);
+}
+
+void pstore_watch(pstore_t* ps, pstore_watch_t* watch)
+{
+    pthread_mutex_lock(&ps->lock);
+    watch->next = ps->watches;
+    ps->watches = watch;
+    pthread_mutex_unlock(&ps->lock);
+}
+
+void pstore_unwatch(pstore_t* ps, pstore_watch_t* watch)
+{
+    pthread_mutex_lock(&ps->lock);
+    for (pstore_watch_t** pp = &ps->watches; *pp; pp = &(*pp)->next)
+    {
+        if (*pp == watch)
+        {
+            *pp = watch->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&ps->lock);
+}
+
+size_t pstore_boundary(pstore_t* ps, size_t pos)
+{
+    pthread_mutex_lock(&ps->lock);
+    size_t lo = 0;
+    size_t hi = ps->npkts;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (ps->pkts[mid] < pos)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    size_t off = (pos <= ps->start) ? ps->start : ((lo < ps->npkts) ? ps->pkts[lo] : ps->size);
+    pthread_mutex_unlock(&ps->lock);
+    return off;
+}
+
+int pstore_packet(pstore_t* ps, size_t n, size_t* off, size_t* end)
+{
+    int rc = -1;
+    pthread_mutex_lock(&ps->lock);
+    if (n < ps->npkts)
+    {
+        *off = n ? ps->pkts[n - 1] : ps->start;
+        *end = ps->pkts[n];
+        rc = 0;
+    }
+    pthread_mutex_unlock(&ps->lock);
+    return rc;
+}
+
+int pstore_seek(pstore_t* ps, size_t cmd, size_t cmd_off, size_t* off)
+{
+    size_t start, end;
+    if (pstore_packet(ps, cmd, &start, &end) != 0 || cmd_off >= end - start)
+    {
+        return -1;
+    }
+    *off = start + cmd_off;
+    return 0;
+}
+
+int pstore_iov(pstore_t* ps, size_t* off, size_t end, struct iovec* iov, int iovcnt)
+{
+    pthread_mutex_lock(&ps->lock);
+    int cnt = pstore_iov_locked(ps, off, end, iov, iovcnt);
+    pthread_mutex_unlock(&ps->lock);
+    return cnt;
+}
+
+void pstore_iov_done(pstore_t* ps, size_t off, int iovcnt)
+{
+    pthread_mutex_lock(&ps->lock);
+    if (ps->ring)
+    {
+        // a packet dropped meanwhile had its pins handed to the writer
+        if (off < ps->start)
+        {
+            if (--ps->ring_stale == 0)
+            {
+                pthread_cond_broadcast(&ps->unpinned);
+            }
+        }
+        else
+        {
+            ps->ring_pins[pstore_count(ps, off)]--;
+        }
+        pthread_mutex_unlock(&ps->lock);
+        return;
+    }
+    size_t idx = pstore_file_at(ps, off);
+    for (int i = 0; i < iovcnt; i++)
+    {
+        ps->files[idx + i].refs--;
+    }
+    pthread_mutex_unlock(&ps->lock);
+}
+
+bool pstore_is_ring(pstore_t* ps)
+{
+    return ps->ring != NULL;
+}
+
+/*
+ * Wait for a blocking socket @param fd to take more after a MSG_DONTWAIT send
+ * came back short, as long as its send timeout allows.
+ * @return 0 once it is writable, -1 with errno EAGAIN if the socket is
+ * non-blocking or the timeout passed.
+ */
+static int pstore_writable(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || (flags & O_NONBLOCK))
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+    struct timeval tv = {0};
+    socklen_t len = sizeof(tv);
+    int ms = -1;
+    if (getsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, &len) == 0 && (tv.tv_sec || tv.tv_usec))
+    {
+        ms = tv.tv_sec * 1000 + tv.tv_usec / 1000;
+    }
+    struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+    int n = poll(&pfd, 1, ms);
+    if (n == 0)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+    if (n < 0 && errno != EINTR)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+int pstore_send(pstore_t* ps, int fd, size_t* off, size_t end)
+{
+    struct iovec iov[PSTORE_IOV_MAX];
+    struct msghdr msg;
+
+    while (*off < end)
+    {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = pstore_iov(ps, off, end, iov, PSTORE_IOV_MAX);
+        if (msg.msg_iovlen == 0)
+        {
+            if (*off >= end)
+            {
+                // all of it was dropped by retention
+                break;
+            }
+            errno = EINVAL;
+            return -1;
+        }
+        // the writer of a ring waits for the pin, so never block holding it
+        ssize_t sz = sendmsg(fd, &msg, MSG_NOSIGNAL | (ps->ring ? MSG_DONTWAIT : 0));
+        pstore_iov_done(ps, *off, msg.msg_iovlen);
+        if (sz < 0)
+        {
+            if (errno == EINTR ||
+                (ps->ring && (errno == EAGAIN || errno == EWOULDBLOCK) && pstore_writable(fd) == 0))
+            {
+                continue;
+            }
+            return -1;
+        }
+        *off += sz;
+    }
+    return 0;
+}
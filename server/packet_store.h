@@ -0,0 +1,265 @@
+#ifndef PACKET_STORE_H
+#define PACKET_STORE_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/uio.h>
+
+/**
+ * Append-only log of received packets, kept in a series of backing files that
+ * are mapped read-only. Replies are sent straight from the mapped pages, so
+ * every reader shares the page cache and nothing is copied to the heap.
+ * Readers pin the files they point into through pstore_iov until they are
+ * done with them, a mapping a file outgrew stays valid until then.
+ * Packet boundaries (the offset just past each newline) are indexed as bytes
+ * are appended so single packets and positions can be looked up directly.
+ * Appends are handed to a single writer thread through a lock-free queue. It
+ * takes everything queued since its last pass as one batch, stores the packets
+ * in arrival order and writes the batch from the request buffers to the
+ * current file with one writev (group commit). Only then are the new bytes
+ * indexed, visible to readers and the requests completed.
+ * The committed size is published last, so it is a snapshot readers take
+ * without the lock: every byte below it is written, indexed and never changes
+ * again. A replay streams up to the size it took from the mapping while the
+ * writer goes on appending past it. Readers hold the lock only to pin pages,
+ * never across a send, so the writer does not wait for a replay to finish.
+ * The first file is the one at path itself, which holds the whole log unless
+ * retention limits are set. With limits, the writer moves on to a new file at
+ * the first packet boundary after the current one reached PSTORE_FILE_SIZE,
+ * named <path>.<offset of its first byte in hex>, and a reaper thread drops
+ * the oldest files, along with their packets, once the limits are exceeded.
+ * Log offsets keep counting across dropped files, packets are counted from
+ * the oldest one retained. A store without a path keeps its files in
+ * anonymous memory files.
+ * Files left by a previous run are loaded at start up.
+ * A ring store instead keeps only the last packets, like the circular buffer
+ * of the aesd char driver, in one memory file allocated up front and mapped
+ * twice in a row so every stored range is contiguous. The writer drops the
+ * oldest packets before it copies a new one over them, waiting only for the
+ * pstore_iov entries still pinning them, which ring readers hand back after a
+ * single non-blocking send.
+ */
+typedef struct pstore_file_s pstore_file_t;
+
+#define PSTORE_FILE_SIZE    0x100000
+#define PSTORE_DEFAULT_SYNC_MS  1000
+#define PSTORE_RING_DEFAULT_PACKETS 10
+#define PSTORE_RING_DEFAULT_BYTES   0x100000
+
+/*
+ * When written packets reach the disk. A batch is synced as a whole, so one
+ * fdatasync covers every client that appended concurrently.
+ */
+enum pstore_sync {
+    PSTORE_SYNC_MEMORY,     // store without a path, nothing is written to disk
+    PSTORE_SYNC_BUFFERED,   // left to the kernel's writeback
+    PSTORE_SYNC_INTERVAL,   // synced in the background at most an interval after a batch
+    PSTORE_SYNC_ALWAYS,     // every batch synced before its appends complete
+};
+
+/**
+ * An append waiting for the writer thread. buf must stay valid until the
+ * request completes, at which point rc is 0 or -1 and end is the size of the
+ * log after the batch holding the packet was written.
+ */
+typedef struct pstore_req_s pstore_req_t;
+struct pstore_req_s {
+    const char* buf;
+    size_t len;
+    void (*complete)(pstore_req_t* req);
+    void* arg;
+    int rc;
+    size_t end;
+    bool done;
+    pstore_req_t* next;
+};
+
+/**
+ * Told about every batch the writer completes, so one append can wake any
+ * number of readers following the log. notify is called with the store lock
+ * held and must not call back into the store.
+ */
+typedef struct pstore_watch_s pstore_watch_t;
+struct pstore_watch_s {
+    void (*notify)(pstore_watch_t* watch);
+    void* arg;
+    pstore_watch_t* next;
+};
+
+typedef struct pstore_s pstore_t;
+struct pstore_s {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_cond_t committed;
+    pthread_cond_t reap;
+    size_t start;
+    size_t size;
+    size_t* pkts;
+    size_t npkts;
+    size_t cappkts;
+    char* path;
+    int fd;
+    pstore_file_t* files;
+    size_t nfiles;
+    size_t capfiles;
+    size_t retain_bytes;
+    size_t retain_pkts;
+    time_t retain_age;
+    enum pstore_sync sync;
+    int sync_ms;
+    bool dirty;
+    uint64_t dirty_since;
+    char* ring;
+    size_t ring_cap;
+    size_t ring_pkts;
+    unsigned* ring_pins;
+    unsigned ring_stale;
+    pthread_cond_t unpinned;
+    bool stop;
+    bool interrupted;
+    pstore_req_t* pending;
+    pstore_watch_t* watches;
+    pthread_t writer;
+    pthread_t reaper;
+};
+
+/**
+* Initialize @param ps, backed by the file at @param path if it is not NULL.
+* @return 0 on success, -1 on error.
+*/
+int pstore_init(pstore_t* ps, const char* path);
+
+/**
+* Initialize @param ps as a ring in memory holding the last @param packets
+* packets within @param bytes bytes, rounded up to whole pages. Both are
+* allocated now and never grow, a longer packet fails to append.
+* @return 0 on success, -1 on error.
+*/
+int pstore_init_ring(pstore_t* ps, size_t packets, size_t bytes);
+
+/**
+* Complete outstanding appends, flush them to disk and release the store.
+*/
+void pstore_destroy(pstore_t* ps);
+
+/**
+* Remove the backing files of a store at @param path.
+*/
+void pstore_remove(const char* path);
+
+/**
+* Split the log into files of about PSTORE_FILE_SIZE bytes from now on and
+* drop the oldest backing file while the files after it still hold at least
+* @param bytes bytes or @param packets packets, or once nothing was written to
+* it for @param age seconds. 0 disables a limit.
+*/
+void pstore_retain(pstore_t* ps, size_t bytes, size_t packets, time_t age);
+
+/**
+* Sync written packets to disk per @param mode. With PSTORE_SYNC_INTERVAL a batch
+* is synced within @param interval_ms milliseconds, appends complete as soon as
+* it is written, so at most that much acknowledged data can be lost. With
+* PSTORE_SYNC_ALWAYS appends complete, and become visible to readers, only once
+* they are on disk. The store starts out PSTORE_SYNC_BUFFERED, or
+* PSTORE_SYNC_MEMORY without a path.
+*/
+void pstore_durability(pstore_t* ps, enum pstore_sync mode, int interval_ms);
+
+/**
+* Queue @param req for the writer thread without waiting. req->complete is
+* called from the writer thread once the packet is stored and written.
+*/
+void pstore_submit(pstore_t* ps, pstore_req_t* req);
+
+/**
+* Append the @param len bytes at @param buf to the log as one unit and wait
+* until the batch holding them was written.
+* @return 0 on success, -1 if memory could not be allocated or the write failed.
+*/
+int pstore_append(pstore_t* ps, const char* buf, size_t len);
+
+/**
+* @return the number of bytes stored so far, which is the log offset the next
+* append starts at. Read without the lock, it never ends inside a batch.
+*/
+size_t pstore_size(pstore_t* ps);
+
+/**
+* @return the log offset of the oldest byte retained.
+*/
+size_t pstore_start(pstore_t* ps);
+
+/**
+* Wait up to @param ms milliseconds for the log to grow past @param off.
+* @return the number of bytes stored.
+*/
+size_t pstore_wait(pstore_t* ps, size_t off, int ms);
+
+/**
+* Wake every pstore_wait caller and make later calls return at once, for
+* shutting down.
+*/
+void pstore_interrupt(pstore_t* ps);
+
+/**
+* Start calling @param watch after every completed batch.
+*/
+void pstore_watch(pstore_t* ps, pstore_watch_t* watch);
+
+/**
+* Stop calling @param watch, it is not called anymore once this returns.
+*/
+void pstore_unwatch(pstore_t* ps, pstore_watch_t* watch);
+
+/**
+* Look up the bounds [*@param off, *@param end) of packet @param n, counted from 0.
+* @return 0 on success, -1 if fewer packets are stored.
+*/
+int pstore_packet(pstore_t* ps, size_t n, size_t* off, size_t* end);
+
+/**
+* @return the first packet boundary at or after log offset @param pos, or the
+* log size if no packet ends there.
+*/
+size_t pstore_boundary(pstore_t* ps, size_t pos);
+
+/**
+* Translate byte @param cmd_off of packet (write command) @param cmd into the log
+* offset *@param off, like the AESDCHAR_IOCSEEKTO ioctl of the aesd char driver.
+* @return 0 on success, -1 if the position is not stored.
+*/
+int pstore_seek(pstore_t* ps, size_t cmd, size_t cmd_off, size_t* off);
+
+/**
+* Describe the stored bytes in [*@param off, @param end) with at most @param iovcnt
+* entries of @param iov, pointing directly into the store. *@param off is first
+* moved past bytes that are no longer retained. The entries stay valid until
+* they are handed back with pstore_iov_done.
+* @return the number of entries filled.
+*/
+int pstore_iov(pstore_t* ps, size_t* off, size_t end, struct iovec* iov, int iovcnt);
+
+/**
+* Release the @param iovcnt entries pstore_iov filled for offset @param off.
+*/
+void pstore_iov_done(pstore_t* ps, size_t off, int iovcnt);
+
+/**
+* @return true if @param ps is a ring, whose writer waits for pstore_iov
+* entries to be released, so they should only be held by non-blocking sends.
+*/
+bool pstore_is_ring(pstore_t* ps);
+
+/**
+* Send the stored bytes in [*@param off, @param end) to socket @param fd,
+* advancing *@param off by what was sent, and past what is no longer retained.
+* Works for blocking and non-blocking sockets.
+* @return 0 once everything was sent, -1 with errno set otherwise (EAGAIN if a
+* non-blocking socket is full).
+*/
+int pstore_send(pstore_t* ps, int fd, size_t* off, size_t end);
+
+#endif
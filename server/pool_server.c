@@ -0,0 +1,607 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include "aesdsocket.h"
+#include "arena.h"
+#include "conn_registry.h"
+#include "framer.h"
+#include "logger.h"
+#include "metrics.h"
+#include "pool_server.h"
+#include "protocol.h"
+
+#define POOL_WAIT_MS    1000
+#define POOL_DRAIN_MS   10
+#define POOL_SUB_SHARE  2
+
+static int pool_sndtimeo = POOL_DEFAULT_SEND_TIMEOUT;
+static size_t pool_recv_bytes = POOL_DEFAULT_RECV_SIZE;
+
+typedef struct pool_conn_s pool_conn_t;
+struct pool_conn_s {
+    arena_t* arena;
+    int fd;
+    metrics_conn_t met;
+    char peer[INET6_ADDRSTRLEN];
+};
+
+/*
+ * Accepted connections wait in a ring of depth entries until a worker takes
+ * them. The worker registers the connection while serving it, so a shutdown
+ * can unblock it, and marks it complete for the reclaimer to close after.
+ * A subscriber holds its worker for as long as it follows the log, so at most
+ * max_subs of them, one worker in POOL_SUB_SHARE, do at a time and the others
+ * are left for clients sending data.
+ */
+typedef struct pool_s pool_t;
+struct pool_s {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    pthread_cond_t space;
+    chan_set_t* chans;
+    sigs_t* sigs;
+    enum pool_overload overload;
+    pool_conn_t** queue;
+    int depth;
+    int head;
+    int count;
+    bool stop;
+    int subs;
+    int max_subs;
+    creg_t reg;
+};
+
+/*
+ * Every listener has its own accepting thread feeding the shared queue. The
+ * first one runs on the calling thread and also drives the ticker and reads
+ * the signals.
+ */
+typedef struct pool_acceptor_s pool_acceptor_t;
+struct pool_acceptor_s {
+    pool_t* p;
+    int sfd;
+    ticker_t* tick;
+    sigs_t* sigs;
+    pthread_t thread;
+    int rc;
+};
+
+static void pool_close(void* arg)
+{
+    pool_conn_t* conn = (pool_conn_t*)arg;
+    close(conn->fd);
+    metrics_closed(&conn->met);
+    LOGGER(LOG_INFO, "Closed connection from %s", conn->peer);
+    arena_destroy(conn->arena);
+}
+
+/* @return true if the peer of @param conn hung up or the socket failed */
+static bool pool_gone(pool_conn_t* conn)
+{
+    struct pollfd pfd = { conn->fd, POLLRDHUP, 0 };
+    return poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLRDHUP | POLLHUP | POLLERR));
+}
+
+/**
+ * Stream everything appended to @param store past @param off to the subscriber
+ * on @param conn until it goes away, which is checked at least every
+ * POOL_WAIT_MS so a quiet log does not keep a worker for a closed subscriber.
+ */
+static void pool_follow(pool_t* p, pstore_t* store, pool_conn_t* conn, size_t off)
+{
+    if (__atomic_add_fetch(&p->subs, 1, __ATOMIC_RELAXED) > p->max_subs)
+    {
+        __atomic_sub_fetch(&p->subs, 1, __ATOMIC_RELAXED);
+        LOGGER(LOG_INFO, "%d subscribers already hold workers, closing %s", p->max_subs, conn->peer);
+        return;
+    }
+    LOGGER(LOG_INFO, "%s subscribed at offset %zu", conn->peer, off);
+    metrics_add(METRICS_SUBSCRIBED, 1);
+    while (run)
+    {
+        size_t end;
+        pstore_wait(store, off, POOL_WAIT_MS);
+        if (pool_gone(conn))
+        {
+            LOGGER(LOG_INFO, "Subscriber %s hung up", conn->peer);
+            break;
+        }
+        if (proto_tail(store, &off, &end) != 0)
+        {
+            break;
+        }
+        size_t from = off;
+        if (pstore_send(store, conn->fd, &off, end) != 0)
+        {
+            LOGGER(LOG_INFO, "Subscriber %s gone: %s", conn->peer, strerror(errno));
+            break;
+        }
+        metrics_add(METRICS_REPLY_BYTES, off - from);
+    }
+    metrics_add(METRICS_UNSUBSCRIBED, 1);
+    __atomic_sub_fetch(&p->subs, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Wait for the next packet on @param conn, which has nothing buffered. A
+ * stopping server closes connections that are between packets right away.
+ * @return true once the socket is readable, false to close the connection.
+ */
+static bool pool_idle(sigs_t* sigs, pool_conn_t* conn)
+{
+    struct pollfd pfd[2];
+    pfd[0].fd = conn->fd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = sigs->stopfd;
+    pfd[1].events = POLLIN;
+    while (run)
+    {
+        int n = poll(pfd, 2, -1);
+        if (n < 0 && errno != EINTR)
+        {
+            LOGGER(LOG_ERR, "Error waiting for receive data: %s", strerror(errno));
+            return false;
+        }
+        if (n > 0 && pfd[0].revents)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Serve packets from @param conn until the peer stops sending. Packets are
+ * answered one after the other, so pipelined replies keep their order.
+ * Between packets the socket is only polled once it has nothing to read, so
+ * a shutdown can end the connection there.
+ */
+static void pool_serve(pool_t* p, pool_conn_t* conn)
+{
+    // channel 0 is the default one
+    pstore_t* chan = p->chans->stores[0];
+    framer_t in;
+    size_t served = 0;
+    bool eof = false;
+
+    framer_init(&in);
+    for (;;)
+    {
+        const char* pkt;
+        size_t len;
+        if (!framer_next(&in, &pkt, &len))
+        {
+            if (!eof)
+            {
+                size_t avail;
+                char* space = framer_space(&in, __atomic_load_n(&pool_recv_bytes, __ATOMIC_RELAXED), &avail);
+                if (!space)
+                {
+                    LOGGER(LOG_ERR, "Could not grow receive buffer: %s", strerror(errno));
+                    break;
+                }
+                int flags = framer_pending(&in) ? 0 : MSG_DONTWAIT;
+                ssize_t sz = recv(conn->fd, space, avail, flags);
+                if (sz < 0)
+                {
+                    if (errno == EINTR)
+                    {
+                        continue;
+                    }
+                    if (flags && (errno == EAGAIN || errno == EWOULDBLOCK))
+                    {
+                        if (!pool_idle(p->sigs, conn))
+                        {
+                            break;
+                        }
+                        continue;
+                    }
+                    LOGGER(LOG_ERR, "Error while waiting for receive data: %s", strerror(errno));
+                    break;
+                }
+                LOGGER(LOG_DEBUG, "Read %zd characters from socket", sz);
+                if (sz == 0)
+                {
+                    eof = true;
+                }
+                else
+                {
+                    metrics_received(&conn->met, sz);
+                }
+                framer_fill(&in, sz);
+                continue;
+            }
+            // peer finished sending, store what is left of an unterminated packet
+            len = framer_rest(&in, &pkt);
+            if (len == 0 && served > 0)
+            {
+                break;
+            }
+        }
+        metrics_packet(&conn->met, framer_pending(&in));
+
+        size_t off, end;
+        pstore_t* store = chan;
+        metrics_append_start(&conn->met);
+        int kind = proto_handle(&store, pkt, len, &off, &end);
+        if (kind < 0)
+        {
+            break;
+        }
+        if (kind == PROTO_CHANNEL)
+        {
+            chan = store;
+        }
+        if (kind == PROTO_DATA)
+        {
+            metrics_appended(&conn->met);
+        }
+        if (kind == PROTO_SUBSCRIBE)
+        {
+            pool_follow(p, store, conn, off);
+            break;
+        }
+        metrics_reply_start(&conn->met, off);
+        if (pstore_send(store, conn->fd, &off, end) != 0)
+        {
+            LOGGER(LOG_ERR, "Error sending data to socket: %s", strerror(errno));
+            break;
+        }
+        metrics_replied(&conn->met, off);
+        LOGGER(LOG_DEBUG, "Sent %zu bytes to socket", off);
+        served++;
+    }
+    framer_free(&in);
+}
+
+static void* pool_worker(void* arg)
+{
+    pool_t* p = (pool_t*)arg;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&p->lock);
+        while (p->count == 0 && !p->stop)
+        {
+            pthread_cond_wait(&p->ready, &p->lock);
+        }
+        if (p->count == 0)
+        {
+            pthread_mutex_unlock(&p->lock);
+            break;
+        }
+        pool_conn_t* conn = p->queue[p->head];
+        p->head = (p->head + 1) % p->depth;
+        p->count--;
+        metrics_add(METRICS_DEQUEUED, 1);
+        // registered before the lock is dropped so a shutdown snapshot sees it
+        int slot = creg_insert(&p->reg, conn->fd, conn);
+        pthread_cond_signal(&p->space);
+        pthread_mutex_unlock(&p->lock);
+
+        if (slot < 0)
+        {
+            LOGGER(LOG_ERR, "Connection registry full, dropping %s", conn->peer);
+            pool_close(conn);
+            continue;
+        }
+        pool_serve(p, conn);
+        creg_complete(&p->reg, slot);
+    }
+    return NULL;
+}
+
+void pool_send_timeout(int sec)
+{
+    __atomic_store_n(&pool_sndtimeo, sec, __ATOMIC_RELAXED);
+}
+
+void pool_recv_size(size_t bytes)
+{
+    __atomic_store_n(&pool_recv_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+static pool_conn_t* pool_accept(int sfd)
+{
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    int afd = accept4(sfd, (struct sockaddr*)&addr, &addrlen, SOCK_CLOEXEC);
+    if (afd < 0)
+    {
+        if (errno != EINTR && errno != ECONNABORTED && errno != EAGAIN)
+        {
+            LOGGER(LOG_ERR, "Error accepting connection: %s", strerror(errno));
+        }
+        return NULL;
+    }
+
+    arena_t* arena = arena_create();
+    pool_conn_t* conn = arena ? arena_alloc(arena, sizeof(pool_conn_t)) : NULL;
+    if (!conn)
+    {
+        LOGGER(LOG_ERR, "Could not allocate memory for connection");
+        if (arena)
+        {
+            arena_destroy(arena);
+        }
+        close(afd);
+        return NULL;
+    }
+    conn->arena = arena;
+    conn->fd = afd;
+    metrics_accepted(&conn->met);
+    struct timeval tv = { __atomic_load_n(&pool_sndtimeo, __ATOMIC_RELAXED), 0 };
+    if (setsockopt(afd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) != 0)
+    {
+        LOGGER(LOG_ERR, "Could not set send timeout: %s", strerror(errno));
+    }
+    if (getnameinfo((struct sockaddr*)&addr, addrlen, conn->peer, sizeof(conn->peer),
+                    NULL, 0, NI_NUMERICHOST) != 0)
+    {
+        strcpy(conn->peer, "unknown");
+    }
+    LOGGER(LOG_INFO, "Accepted connection from %s", conn->peer);
+    return conn;
+}
+
+/* caller holds p->lock */
+static void pool_enqueue(pool_t* p, pool_conn_t* conn)
+{
+    if (p->count == p->depth)
+    {
+        if (p->overload == POOL_REJECT)
+        {
+            LOGGER(LOG_INFO, "Accept queue full, rejecting %s", conn->peer);
+            metrics_add(METRICS_REJECTED, 1);
+            pool_close(conn);
+            return;
+        }
+        // POOL_SHED, the acceptor waits for space with POOL_QUEUE
+        pool_conn_t* old = p->queue[p->head];
+        p->head = (p->head + 1) % p->depth;
+        p->count--;
+        metrics_add(METRICS_DEQUEUED, 1);
+        metrics_add(METRICS_SHED, 1);
+        LOGGER(LOG_INFO, "Accept queue full, shedding %s", old->peer);
+        pool_close(old);
+    }
+    p->queue[(p->head + p->count) % p->depth] = conn;
+    p->count++;
+    metrics_add(METRICS_QUEUED, 1);
+    pthread_cond_signal(&p->ready);
+}
+
+/*
+ * Caller holds p->lock, @return false once run was cleared. The ticker and
+ * the signals keep going while the acceptor waits, without the lock: a
+ * timestamp waits for its batch to be written and a reload may sync, and
+ * the workers must keep emptying the queue meanwhile.
+ */
+static bool pool_wait_space(pool_t* p, pool_acceptor_t* a)
+{
+    while (run && p->overload == POOL_QUEUE && p->count == p->depth)
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += POOL_WAIT_MS / 1000;
+        pthread_cond_timedwait(&p->space, &p->lock, &ts);
+        if (a->tick)
+        {
+            pthread_mutex_unlock(&p->lock);
+            ticker_expired(a->tick);
+            sigs_read(a->sigs);
+            pthread_mutex_lock(&p->lock);
+        }
+    }
+    return run;
+}
+
+/* accept from one listener until run is cleared, a->rc is -1 after an error */
+static void* pool_acceptor(void* arg)
+{
+    pool_acceptor_t* a = (pool_acceptor_t*)arg;
+    pool_t* p = a->p;
+
+    a->rc = 0;
+    for (;;)
+    {
+        pthread_mutex_lock(&p->lock);
+        bool more = pool_wait_space(p, a);
+        pthread_mutex_unlock(&p->lock);
+        if (!more)
+        {
+            break;
+        }
+
+        struct pollfd pfd[4];
+        pfd[0].fd = a->sfd;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = p->sigs->stopfd;
+        pfd[1].events = POLLIN;
+        if (a->tick)
+        {
+            pfd[2].fd = a->tick->fd;
+            pfd[2].events = POLLIN;
+            pfd[3].fd = a->sigs->fd;
+            pfd[3].events = POLLIN;
+        }
+        int n = poll(pfd, a->tick ? 4 : 2, POOL_WAIT_MS);
+        if (n < 0 && errno != EINTR)
+        {
+            LOGGER(LOG_ERR, "Error waiting for connections: %s", strerror(errno));
+            a->rc = -1;
+            // the other acceptors and the caller stop with us
+            sigs_stop(p->sigs);
+            break;
+        }
+        if (n > 0 && a->tick && (pfd[2].revents & POLLIN))
+        {
+            ticker_expired(a->tick);
+        }
+        if (n > 0 && a->tick && (pfd[3].revents & POLLIN))
+        {
+            sigs_read(a->sigs);
+        }
+        if (n <= 0 || !(pfd[0].revents & POLLIN))
+        {
+            continue;
+        }
+
+        pool_conn_t* conn = pool_accept(a->sfd);
+        if (conn)
+        {
+            pthread_mutex_lock(&p->lock);
+            pool_enqueue(p, conn);
+            pthread_mutex_unlock(&p->lock);
+        }
+    }
+    return NULL;
+}
+
+int pool_server_run(const lsn_set_t* lsn, chan_set_t* chans, ticker_t* tick, sigs_t* sigs,
+                    int nworkers, int depth, enum pool_overload overload)
+{
+    int rc = -1;
+    int started = 0;
+    int accepting = 1;
+    pthread_t* threads = NULL;
+    pool_acceptor_t* acceptors = NULL;
+    pool_t p;
+
+    memset(&p, 0, sizeof(p));
+    p.chans = chans;
+    p.sigs = sigs;
+    p.overload = overload;
+    p.depth = depth;
+    p.max_subs = nworkers / POOL_SUB_SHARE;
+    // room for completed connections the reclaimer has not recycled yet
+    if (creg_init(&p.reg, 2 * (size_t)nworkers, pool_close) != 0)
+    {
+        return -1;
+    }
+    pthread_mutex_init(&p.lock, NULL);
+    pthread_cond_init(&p.ready, NULL);
+    pthread_cond_init(&p.space, NULL);
+
+    p.queue = calloc(depth, sizeof(pool_conn_t*));
+    threads = calloc(nworkers, sizeof(pthread_t));
+    acceptors = calloc(lsn->count, sizeof(pool_acceptor_t));
+    if (!p.queue || !threads || !acceptors)
+    {
+        LOGGER(LOG_ERR, "Could not allocate memory for %d workers", nworkers);
+        goto error;
+    }
+    for (; started < nworkers; started++)
+    {
+        int prc = pthread_create(&threads[started], NULL, pool_worker, &p);
+        if (prc != 0)
+        {
+            LOGGER(LOG_ERR, "Could not create worker thread: %d", prc);
+            goto stop;
+        }
+    }
+    for (int i = 0; i < lsn->count; i++)
+    {
+        acceptors[i].p = &p;
+        acceptors[i].sfd = lsn->fds[i];
+        acceptors[i].tick = (i == 0) ? tick : NULL;
+        acceptors[i].sigs = (i == 0) ? sigs : NULL;
+    }
+    for (; accepting < lsn->count; accepting++)
+    {
+        int prc = pthread_create(&acceptors[accepting].thread, NULL, pool_acceptor, &acceptors[accepting]);
+        if (prc != 0)
+        {
+            LOGGER(LOG_ERR, "Could not create acceptor thread: %d", prc);
+            sigs_stop(sigs);
+            break;
+        }
+    }
+    LOGGER(LOG_INFO, "Started %d pool workers and %d acceptors, accept queue depth %d",
+           nworkers, accepting, depth);
+
+    pool_acceptor(&acceptors[0]);
+    rc = acceptors[0].rc;
+    for (int i = 1; i < accepting; i++)
+    {
+        pthread_join(acceptors[i].thread, NULL);
+        rc = (acceptors[i].rc != 0) ? acceptors[i].rc : rc;
+    }
+    if (accepting < lsn->count)
+    {
+        rc = -1;
+    }
+
+stop:
+    sigs_stop(sigs);
+    // workers serve what was accepted, closing connections once between packets
+    pthread_mutex_lock(&p.lock);
+    p.stop = true;
+    pthread_cond_broadcast(&p.ready);
+    pthread_mutex_unlock(&p.lock);
+    chan_interrupt(chans);
+    for (;;)
+    {
+        pthread_mutex_lock(&p.lock);
+        bool busy = p.count > 0 || creg_count(&p.reg) > 0;
+        pthread_mutex_unlock(&p.lock);
+        if (!busy || sigs_drain_ms(sigs) == 0)
+        {
+            break;
+        }
+        poll(NULL, 0, POOL_DRAIN_MS);
+    }
+
+    // past the deadline, drop connections nobody started on and unblock the
+    // ones still being served
+    pthread_mutex_lock(&p.lock);
+    while (p.count > 0)
+    {
+        pool_close(p.queue[p.head]);
+        p.head = (p.head + 1) % p.depth;
+        p.count--;
+        metrics_add(METRICS_DEQUEUED, 1);
+    }
+    pthread_mutex_unlock(&p.lock);
+
+    int* fds = calloc(p.reg.capacity, sizeof(int));
+    if (fds)
+    {
+        size_t n = creg_snapshot(&p.reg, fds, p.reg.capacity);
+        if (n > 0)
+        {
+            LOGGER(LOG_INFO, "Drain deadline passed, shutting down %zu active connections", n);
+        }
+        // best effort, a connection completing now may already have closed its socket
+        for (size_t i = 0; i < n; i++)
+        {
+            shutdown(fds[i], SHUT_RDWR);
+        }
+        free(fds);
+    }
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+error:
+    creg_destroy(&p.reg);
+    free(acceptors);
+    free(threads);
+    free(p.queue);
+    pthread_cond_destroy(&p.space);
+    pthread_cond_destroy(&p.ready);
+    pthread_mutex_destroy(&p.lock);
+    return rc;
+}
@@ -0,0 +1,52 @@
+#ifndef POOL_SERVER_H
+#define POOL_SERVER_H
+
+#include "channels.h"
+#include "listener.h"
+#include "signals.h"
+#include "ticker.h"
+
+#define POOL_DEFAULT_WORKERS    32
+#define POOL_DEFAULT_DEPTH      64
+#define POOL_DEFAULT_SEND_TIMEOUT   30
+#define POOL_DEFAULT_RECV_SIZE  0x4000
+
+/*
+ * What to do with a new connection while the accept queue is full.
+ */
+enum pool_overload {
+    POOL_QUEUE,     // stop accepting until a worker frees a slot
+    POOL_REJECT,    // close the new connection
+    POOL_SHED,      // close the connection waiting longest and queue the new one
+};
+
+/**
+* Close a connection whose peer takes no reply bytes for @param sec seconds,
+* 0 to wait forever. A blocked send would otherwise hold its worker.
+*/
+void pool_send_timeout(int sec);
+
+/**
+* Receive up to @param bytes at a time into the buffer of a connection.
+*/
+void pool_recv_size(size_t bytes);
+
+/**
+* Serve connections on the listening sockets @param lsn with a fixed pool of
+* @param nworkers blocking threads until run is cleared. Every socket has its
+* own accepting thread. Accepted connections
+* wait in a queue of @param depth entries, handled per @param overload when full.
+* A worker serves its connection until the peer stops sending, then closes it
+* right away. A subscriber keeps its worker until it hangs up, so only half of
+* the workers take subscribers, later ones are closed.
+* Packets are appended to and replayed from the channels of @param chans,
+* each connection starting on the default one. The accepting thread
+* also appends the records of @param tick and reads @param sigs. Once stopped,
+* connections are served until they are between packets or the drain deadline
+* of @param sigs passes.
+* @return 0 on a clean shutdown, -1 if the engine could not be started.
+*/
+int pool_server_run(const lsn_set_t* lsn, chan_set_t* chans, ticker_t* tick, sigs_t* sigs,
+                    int nworkers, int depth, enum pool_overload overload);
+
+#endif
@@ -0,0 +1,210 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <syslog.h>
+#include "protocol.h"
+#include "logger.h"
+
+static size_t proto_lag_limit = PROTO_TAIL_DEFAULT_LAG;
+static enum proto_lag proto_lag_policy = PROTO_LAG_DROP;
+static chan_set_t* proto_chans;
+
+static bool proto_prefix(const char** p, const char* e, const char* cmd)
+{
+    size_t n = strlen(cmd);
+    if ((size_t)(e - *p) < n || memcmp(*p, cmd, n) != 0)
+    {
+        return false;
+    }
+    *p += n;
+    return true;
+}
+
+/* a number too large for a size_t is invalid, rather than wrapping around to another one */
+static bool proto_number(const char** p, const char* e, size_t* v)
+{
+    const char* s = *p;
+    *v = 0;
+    while (*p < e && **p >= '0' && **p <= '9')
+    {
+        size_t d = **p - '0';
+        if (*v > (SIZE_MAX - d) / 10)
+        {
+            return false;
+        }
+        *v = *v * 10 + d;
+        (*p)++;
+    }
+    return *p != s;
+}
+
+static bool proto_char(const char** p, const char* e, char c)
+{
+    if (*p < e && **p == c)
+    {
+        (*p)++;
+        return true;
+    }
+    return false;
+}
+
+/* the rest of the packet may only be the terminating newline */
+static bool proto_done(const char* p, const char* e)
+{
+    return p == e || (p + 1 == e && *p == '\n');
+}
+
+static enum proto_kind proto_answer(pstore_t* store, const char* pkt, size_t len, size_t* off, size_t* end)
+{
+    const char* p = pkt;
+    const char* e = pkt + len;
+    size_t a, b;
+
+    if (proto_prefix(&p, e, PROTO_CMD_SEEKTO))
+    {
+        if (proto_number(&p, e, &a) && proto_char(&p, e, ',') &&
+            proto_number(&p, e, &b) && proto_done(p, e) &&
+            pstore_seek(store, a, b, off) == 0)
+        {
+            *end = pstore_size(store);
+        }
+        else
+        {
+            LOGGER(LOG_INFO, "Invalid seek request %.*s", (int)(e - pkt), pkt);
+        }
+        return PROTO_REPLY;
+    }
+    if (proto_prefix(&p, e, PROTO_CMD_PACKET))
+    {
+        if (!proto_number(&p, e, &a) || !proto_done(p, e) ||
+            pstore_packet(store, a, off, end) != 0)
+        {
+            LOGGER(LOG_INFO, "Invalid packet request %.*s", (int)(e - pkt), pkt);
+        }
+        return PROTO_REPLY;
+    }
+    if (proto_prefix(&p, e, PROTO_CMD_RANGE))
+    {
+        size_t size = pstore_size(store);
+        if (proto_number(&p, e, &a) && proto_char(&p, e, ',') &&
+            proto_number(&p, e, &b) && proto_done(p, e) && a <= b && a < size)
+        {
+            *off = a;
+            *end = (b < size) ? b : size;
+        }
+        else
+        {
+            LOGGER(LOG_INFO, "Invalid range request %.*s", (int)(e - pkt), pkt);
+        }
+        return PROTO_REPLY;
+    }
+
+    if (proto_prefix(&p, e, PROTO_CMD_SUBSCRIBE))
+    {
+        if (!proto_done(p, e))
+        {
+            LOGGER(LOG_INFO, "Invalid subscribe request %.*s", (int)(e - pkt), pkt);
+            return PROTO_REPLY;
+        }
+        *off = pstore_size(store);
+        *end = *off;
+        return PROTO_SUBSCRIBE;
+    }
+
+    if (len == 0)
+    {
+        // nothing to store, just replay
+        *end = pstore_size(store);
+        return PROTO_REPLY;
+    }
+    return PROTO_DATA;
+}
+
+void proto_channels(chan_set_t* chans)
+{
+    proto_chans = chans;
+}
+
+enum proto_kind proto_command(pstore_t** store, const char** pkt, size_t* len, size_t* off, size_t* end)
+{
+    const char* p = *pkt;
+    const char* e = *pkt + *len;
+
+    *off = 0;
+    *end = 0;
+    if (proto_prefix(&p, e, PROTO_CMD_CHANNEL))
+    {
+        const char* name = p;
+        while (p < e && *p != ':' && *p != '\n')
+        {
+            p++;
+        }
+        bool prefix = proto_char(&p, e, ':');
+        if (!prefix && !proto_done(p, e))
+        {
+            LOGGER(LOG_INFO, "Invalid channel request %.*s", (int)*len, *pkt);
+            return PROTO_REPLY;
+        }
+        pstore_t* chan = chan_open(proto_chans, name, (prefix ? p - 1 : p) - name);
+        if (!chan)
+        {
+            return PROTO_REPLY;
+        }
+        *store = chan;
+        if (!prefix)
+        {
+            return PROTO_CHANNEL;
+        }
+        *len = e - p;
+        *pkt = p;
+    }
+    return proto_answer(*store, *pkt, *len, off, end);
+}
+
+int proto_handle(pstore_t** store, const char* pkt, size_t len, size_t* off, size_t* end)
+{
+    enum proto_kind kind = proto_command(store, &pkt, &len, off, end);
+    if (kind != PROTO_DATA)
+    {
+        return kind;
+    }
+    if (pstore_append(*store, pkt, len) != 0)
+    {
+        return -1;
+    }
+    *end = pstore_size(*store);
+    return PROTO_DATA;
+}
+
+void proto_tail_limit(size_t lag, enum proto_lag policy)
+{
+    __atomic_store_n(&proto_lag_limit, lag, __ATOMIC_RELAXED);
+    __atomic_store_n(&proto_lag_policy, policy, __ATOMIC_RELAXED);
+}
+
+int proto_tail(pstore_t* store, size_t* off, size_t* end)
+{
+    size_t size = pstore_size(store);
+    size_t next = pstore_boundary(store, *off);
+
+    if (next != *off)
+    {
+        // finish the packet already partly sent before anything else
+        *end = next;
+        return 0;
+    }
+    size_t limit = __atomic_load_n(&proto_lag_limit, __ATOMIC_RELAXED);
+    if (size - *off > limit)
+    {
+        if (__atomic_load_n(&proto_lag_policy, __ATOMIC_RELAXED) == PROTO_LAG_CLOSE)
+        {
+            LOGGER(LOG_INFO, "Subscriber %zu bytes behind, closing", size - *off);
+            return -1;
+        }
+        next = pstore_boundary(store, size - limit);
+        LOGGER(LOG_INFO, "Subscriber %zu bytes behind, dropping %zu", size - *off, next - *off);
+        *off = next;
+    }
+    *end = size;
+    return 0;
+}
@@ -0,0 +1,88 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "channels.h"
+#include "packet_store.h"
+
+/*
+ * Commands a client may send instead of a data packet. They are answered from
+ * the packet index and never stored.
+ *   AESDCHAR_IOCSEEKTO:X,Y   everything from byte Y of write command X on
+ *   AESDSOCKET_PACKET:N      packet N only
+ *   AESDSOCKET_RANGE:A,B     log bytes [A, B)
+ *   AESDSOCKET_SUBSCRIBE     everything appended from now on, until the
+ *                            client disconnects
+ *   AESDSOCKET_CHANNEL:NAME  use channel NAME for the rest of the connection,
+ *                            answered with nothing; an empty NAME is the
+ *                            default channel
+ *   AESDSOCKET_CHANNEL:NAME:PACKET
+ *                            handle PACKET, data or command, on channel NAME
+ * Packets and write commands are counted from 0, the oldest one retained.
+ * Log offsets keep counting past bytes retention dropped, which are skipped.
+ * Every channel counts for itself.
+ */
+#define PROTO_CMD_SEEKTO    "AESDCHAR_IOCSEEKTO:"
+#define PROTO_CMD_PACKET    "AESDSOCKET_PACKET:"
+#define PROTO_CMD_RANGE     "AESDSOCKET_RANGE:"
+#define PROTO_CMD_SUBSCRIBE "AESDSOCKET_SUBSCRIBE"
+#define PROTO_CMD_CHANNEL   "AESDSOCKET_CHANNEL:"
+
+#define PROTO_TAIL_DEFAULT_LAG  0x100000
+
+enum proto_kind {
+    PROTO_DATA,         // store the packet, then reply
+    PROTO_REPLY,        // reply only
+    PROTO_SUBSCRIBE,    // follow the log
+    PROTO_CHANNEL,      // switch the connection to another channel, reply only
+};
+
+/*
+ * What to do with a subscriber that falls more than the lag limit behind.
+ */
+enum proto_lag {
+    PROTO_LAG_DROP,     // skip the oldest unsent packets
+    PROTO_LAG_CLOSE,    // disconnect it
+};
+
+/**
+* Select the channels that AESDSOCKET_CHANNEL names from @param chans.
+*/
+void proto_channels(chan_set_t* chans);
+
+/**
+* Answer the complete packet of *@param len bytes at *@param pkt if it is a
+* command or empty, setting [*@param off, *@param end) to the part of the log to
+* send back (empty for a command naming a position that is not stored). A
+* subscriber starts with the empty range at the end of the log.
+* *@param store is the channel of the connection on entry and the channel the
+* packet is for on return, with a channel prefix stripped off the packet.
+* @return PROTO_DATA if the packet is data to append to *store, else what it
+* asked for. PROTO_CHANNEL leaves the channel to switch to in *store.
+*/
+enum proto_kind proto_command(pstore_t** store, const char** pkt, size_t* len, size_t* off, size_t* end);
+
+/**
+* Handle the complete packet of @param len bytes at @param pkt: a command is
+* answered as by proto_command, anything else is appended to *@param store and
+* waited for. [*@param off, *@param end) is set to the part of the log of
+* *store to send back.
+* @return the proto_kind of the packet, -1 if it could not be stored.
+*/
+int proto_handle(pstore_t** store, const char* pkt, size_t len, size_t* off, size_t* end);
+
+/**
+* Let subscribers fall at most @param lag bytes behind, handled per @param policy.
+*/
+void proto_tail_limit(size_t lag, enum proto_lag policy);
+
+/**
+* Find what a subscriber that has been sent the log up to *@param off should be
+* sent next, [*@param off, *@param end). A subscriber past the lag limit skips
+* whole packets, or is to be closed, but always finishes a packet it started.
+* @return 0 on success, -1 if the subscriber is to be closed.
+*/
+int proto_tail(pstore_t* store, size_t* off, size_t* end);
+
+#endif
@@ -0,0 +1,126 @@
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include "aesdsocket.h"
+#include "logger.h"
+#include "signals.h"
+#include "slab.h"
+
+static uint64_t sigs_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void sigs_mask(sigset_t* set)
+{
+    sigemptyset(set);
+    sigaddset(set, SIGTERM);
+    sigaddset(set, SIGINT);
+    sigaddset(set, SIGUSR1);
+    sigaddset(set, SIGHUP);
+}
+
+int sigs_init(sigs_t* s, int drain_sec)
+{
+    sigset_t set;
+
+    memset(s, 0, sizeof(sigs_t));
+    s->stopfd = -1;
+    s->drain_ms = drain_sec * 1000;
+    sigs_mask(&set);
+    int rc = pthread_sigmask(SIG_BLOCK, &set, NULL);
+    if (rc != 0)
+    {
+        LOGGER(LOG_ERR, "Could not block signals: %s", strerror(rc));
+        return -1;
+    }
+    s->fd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (s->fd < 0)
+    {
+        LOGGER(LOG_ERR, "Could not create signalfd: %s", strerror(errno));
+        return -1;
+    }
+    // never read, it stays readable once written
+    s->stopfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (s->stopfd < 0)
+    {
+        LOGGER(LOG_ERR, "Could not create stop eventfd: %s", strerror(errno));
+        close(s->fd);
+        s->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+void sigs_read(sigs_t* s)
+{
+    struct signalfd_siginfo si;
+
+    while (read(s->fd, &si, sizeof(si)) == sizeof(si))
+    {
+        switch (si.ssi_signo)
+        {
+        case SIGTERM:
+        case SIGINT:
+            LOGGER(LOG_INFO, "Caught signal %u, draining connections for up to %d ms",
+                   si.ssi_signo, __atomic_load_n(&s->drain_ms, __ATOMIC_RELAXED));
+            sigs_stop(s);
+            break;
+        case SIGUSR1:
+            slab_log_stats();
+            break;
+        case SIGHUP:
+            if (s->reload)
+            {
+                LOGGER(LOG_INFO, "Caught SIGHUP, reloading configuration");
+                s->reload();
+            }
+            break;
+        }
+    }
+}
+
+void sigs_stop(sigs_t* s)
+{
+    uint64_t none = 0;
+    int drain_ms = __atomic_load_n(&s->drain_ms, __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&s->deadline, &none, sigs_now_ms() + drain_ms,
+                                     false, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    {
+        return;
+    }
+    run = false;
+    uint64_t one = 1;
+    if (write(s->stopfd, &one, sizeof(one)) < 0)
+    {
+        LOGGER(LOG_ERR, "Could not wake engine threads: %s", strerror(errno));
+    }
+}
+
+int sigs_drain_ms(sigs_t* s)
+{
+    uint64_t deadline = __atomic_load_n(&s->deadline, __ATOMIC_ACQUIRE);
+    uint64_t now = sigs_now_ms();
+    return (deadline > now) ? (int)(deadline - now) : 0;
+}
+
+void sigs_destroy(sigs_t* s)
+{
+    if (s->fd >= 0)
+    {
+        close(s->fd);
+    }
+    if (s->stopfd >= 0)
+    {
+        close(s->stopfd);
+    }
+}
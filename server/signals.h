@@ -0,0 +1,53 @@
+#ifndef SIGNALS_H
+#define SIGNALS_H
+
+#include <stdint.h>
+
+#define SIGS_DEFAULT_DRAIN_SEC  5
+
+/**
+ * Takes SIGTERM, SIGINT, SIGUSR1 and SIGHUP through a signalfd instead of a
+ * handler, so the engine reads them in its own event loop like any other
+ * descriptor. SIGHUP calls reload, if set, from that loop. Stopping clears
+ * run and makes stopfd readable for good, which every thread waiting in poll,
+ * epoll or the ring watches to wake at once. Connections then get until the
+ * drain deadline to finish what they were sent before they are cut off.
+ */
+typedef struct sigs_s sigs_t;
+struct sigs_s {
+    int fd;
+    int stopfd;
+    int drain_ms;
+    uint64_t deadline;
+    void (*reload)(void);
+};
+
+/**
+* Block the signals in the calling thread, and so in every thread it starts
+* afterwards, and open the descriptors. Connections get @param drain_sec
+* seconds to finish once stopped.
+* @return 0 on success, -1 on error.
+*/
+int sigs_init(sigs_t* s, int drain_sec);
+
+/**
+* Handle the signals pending on the non-blocking signalfd. Called whenever the
+* engine sees the descriptor readable.
+*/
+void sigs_read(sigs_t* s);
+
+/**
+* Stop the server: clear run, start the drain deadline and wake everyone
+* watching stopfd. Only the first call counts.
+*/
+void sigs_stop(sigs_t* s);
+
+/**
+* @return the milliseconds left until the drain deadline, 0 once it passed or
+* if the server was not stopped through sigs_stop.
+*/
+int sigs_drain_ms(sigs_t* s);
+
+void sigs_destroy(sigs_t* s);
+
+#endif
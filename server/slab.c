@@ -0,0 +1,218 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include "slab.h"
+#include "logger.h"
+
+#define SLAB_CLASSES    9
+#define SLAB_MAG        8
+
+/* free buffers link through their first bytes */
+typedef struct slab_free_s slab_free_t;
+struct slab_free_s {
+    slab_free_t* next;
+};
+
+typedef struct slab_class_s slab_class_t;
+struct slab_class_s {
+    pthread_mutex_t lock;
+    slab_free_t* head;
+    size_t count;
+};
+
+typedef struct slab_mag_s slab_mag_t;
+struct slab_mag_s {
+    void* bufs[SLAB_MAG];
+    int n;
+};
+
+static slab_class_t slab_classes[SLAB_CLASSES];
+static slab_stats_t slab_counters;
+static pthread_once_t slab_once = PTHREAD_ONCE_INIT;
+static pthread_key_t slab_key;
+static __thread slab_mag_t slab_mags[SLAB_CLASSES];
+
+static size_t slab_class_size(int c)
+{
+    return (size_t)SLAB_MIN << c;
+}
+
+static int slab_class(size_t size)
+{
+    int c = 0;
+    while (slab_class_size(c) < size)
+    {
+        c++;
+    }
+    return c;
+}
+
+static void slab_count(size_t* counter, size_t n)
+{
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+static void slab_uncount(size_t* counter, size_t n)
+{
+    __atomic_fetch_sub(counter, n, __ATOMIC_RELAXED);
+}
+
+/* move @param n buffers of the magazine to the class list, freeing what it cannot keep */
+static void slab_spill(int c, slab_mag_t* mag, int n)
+{
+    slab_class_t* cl = &slab_classes[c];
+    size_t keep = SLAB_KEEP / slab_class_size(c);
+    slab_free_t* drop = NULL;
+
+    pthread_mutex_lock(&cl->lock);
+    while (n-- > 0)
+    {
+        slab_free_t* f = mag->bufs[--mag->n];
+        if (cl->count < keep)
+        {
+            f->next = cl->head;
+            cl->head = f;
+            cl->count++;
+        }
+        else
+        {
+            f->next = drop;
+            drop = f;
+        }
+    }
+    pthread_mutex_unlock(&cl->lock);
+
+    while (drop)
+    {
+        slab_free_t* f = drop;
+        drop = f->next;
+        free(f);
+        slab_count(&slab_counters.frees, 1);
+        slab_uncount(&slab_counters.cached, slab_class_size(c));
+    }
+}
+
+/* hand the magazines of an exiting thread back to the class lists */
+static void slab_flush(void* arg)
+{
+    for (int c = 0; c < SLAB_CLASSES; c++)
+    {
+        slab_spill(c, &slab_mags[c], slab_mags[c].n);
+    }
+}
+
+static void slab_init(void)
+{
+    for (int c = 0; c < SLAB_CLASSES; c++)
+    {
+        pthread_mutex_init(&slab_classes[c].lock, NULL);
+    }
+    if (pthread_key_create(&slab_key, slab_flush) != 0)
+    {
+        LOGGER(LOG_ERR, "Could not create slab thread key, magazines of exiting threads leak");
+    }
+}
+
+void* slab_get(size_t size, size_t* cap)
+{
+    slab_count(&slab_counters.gets, 1);
+    if (size > SLAB_MAX)
+    {
+        void* buf = malloc(size);
+        if (buf)
+        {
+            *cap = size;
+            slab_count(&slab_counters.oversize, 1);
+            slab_count(&slab_counters.mallocs, 1);
+            slab_count(&slab_counters.in_use, size);
+        }
+        return buf;
+    }
+
+    pthread_once(&slab_once, slab_init);
+    int c = slab_class(size);
+    slab_mag_t* mag = &slab_mags[c];
+    void* buf = NULL;
+    if (mag->n == 0)
+    {
+        // refill half the magazine with one trip to the class lock
+        slab_class_t* cl = &slab_classes[c];
+        pthread_mutex_lock(&cl->lock);
+        while (cl->head && mag->n < SLAB_MAG / 2)
+        {
+            mag->bufs[mag->n++] = cl->head;
+            cl->head = cl->head->next;
+            cl->count--;
+        }
+        pthread_mutex_unlock(&cl->lock);
+    }
+    if (mag->n > 0)
+    {
+        buf = mag->bufs[--mag->n];
+        slab_count(&slab_counters.hits, 1);
+        slab_uncount(&slab_counters.cached, slab_class_size(c));
+    }
+    else
+    {
+        buf = malloc(slab_class_size(c));
+        if (!buf)
+        {
+            return NULL;
+        }
+        slab_count(&slab_counters.mallocs, 1);
+    }
+    *cap = slab_class_size(c);
+    slab_count(&slab_counters.in_use, *cap);
+    return buf;
+}
+
+void slab_put(void* buf, size_t cap)
+{
+    if (!buf)
+    {
+        return;
+    }
+    slab_uncount(&slab_counters.in_use, cap);
+    if (cap > SLAB_MAX)
+    {
+        free(buf);
+        slab_count(&slab_counters.frees, 1);
+        return;
+    }
+
+    pthread_once(&slab_once, slab_init);
+    int c = slab_class(cap);
+    slab_mag_t* mag = &slab_mags[c];
+    if (mag->n == SLAB_MAG)
+    {
+        slab_spill(c, mag, SLAB_MAG / 2);
+    }
+    else if (pthread_getspecific(slab_key) == NULL)
+    {
+        // arm the exit flush the first time this thread keeps buffers
+        pthread_setspecific(slab_key, slab_mags);
+    }
+    mag->bufs[mag->n++] = buf;
+    slab_count(&slab_counters.cached, cap);
+}
+
+void slab_stats(slab_stats_t* st)
+{
+    st->gets = __atomic_load_n(&slab_counters.gets, __ATOMIC_RELAXED);
+    st->hits = __atomic_load_n(&slab_counters.hits, __ATOMIC_RELAXED);
+    st->mallocs = __atomic_load_n(&slab_counters.mallocs, __ATOMIC_RELAXED);
+    st->oversize = __atomic_load_n(&slab_counters.oversize, __ATOMIC_RELAXED);
+    st->frees = __atomic_load_n(&slab_counters.frees, __ATOMIC_RELAXED);
+    st->in_use = __atomic_load_n(&slab_counters.in_use, __ATOMIC_RELAXED);
+    st->cached = __atomic_load_n(&slab_counters.cached, __ATOMIC_RELAXED);
+}
+
+void slab_log_stats(void)
+{
+    slab_stats_t st;
+    slab_stats(&st);
+    LOGGER(LOG_INFO, "Buffers: %zu handed out, %zu recycled, %zu allocated (%zu oversize), "
+           "%zu freed, %zu bytes in use, %zu bytes cached",
+           st.gets, st.hits, st.mallocs, st.oversize, st.frees, st.in_use, st.cached);
+}
@@ -0,0 +1,52 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+
+/**
+ * Process-wide pool of recycled I/O buffers in power of two size classes from
+ * SLAB_MIN to SLAB_MAX bytes. Every thread keeps a small magazine of free
+ * buffers per class and only takes the class lock to refill or spill it half
+ * at a time, so a warm pool hands out and takes back buffers without malloc
+ * and mostly without contention. Each class keeps at most SLAB_KEEP bytes of
+ * free buffers beyond the magazines, the rest goes back to the C library.
+ * Larger buffers are allocated and freed directly.
+ */
+#define SLAB_MIN    0x1000
+#define SLAB_MAX    0x100000
+#define SLAB_KEEP   0x800000
+
+typedef struct slab_stats_s slab_stats_t;
+struct slab_stats_s {
+    size_t gets;        // buffers handed out
+    size_t hits;        // of which were recycled
+    size_t mallocs;     // of which had to be allocated
+    size_t oversize;    // of which were larger than SLAB_MAX
+    size_t frees;       // buffers given back to the C library
+    size_t in_use;      // bytes handed out and not yet put back
+    size_t cached;      // bytes of free buffers kept in the pool
+};
+
+/**
+* Get a buffer of at least @param size bytes, its actual size is stored at
+* *@param cap.
+* @return the buffer, NULL if out of memory.
+*/
+void* slab_get(size_t size, size_t* cap);
+
+/**
+* Put back @param buf of @param cap bytes as returned by slab_get. NULL is ignored.
+*/
+void slab_put(void* buf, size_t cap);
+
+/**
+* Read the counters of the pool into @param st.
+*/
+void slab_stats(slab_stats_t* st);
+
+/**
+* Write the counters of the pool to syslog.
+*/
+void slab_log_stats(void);
+
+#endif
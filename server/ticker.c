@@ -0,0 +1,115 @@
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include "logger.h"
+#include "ticker.h"
+
+#define TICKER_PREFIX "timestamp:"
+
+/* called on the store writer thread */
+static void ticker_written(pstore_req_t* req)
+{
+    ticker_t* t = (ticker_t*)req->arg;
+    if (req->rc != 0)
+    {
+        LOGGER(LOG_ERR, "Could not write %s to file", t->buf);
+    }
+    __atomic_store_n(&t->busy, false, __ATOMIC_RELEASE);
+}
+
+int ticker_init(ticker_t* t, pstore_t* store, int interval)
+{
+    memset(t, 0, sizeof(ticker_t));
+    t->store = store;
+    t->req.complete = ticker_written;
+    t->req.arg = t;
+    t->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (t->fd < 0)
+    {
+        LOGGER(LOG_ERR, "Failed to create timer: %s", strerror(errno));
+        return -1;
+    }
+    if (ticker_interval(t, interval) != 0)
+    {
+        close(t->fd);
+        t->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+int ticker_interval(ticker_t* t, int interval)
+{
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_interval.tv_sec = interval;
+    its.it_value.tv_sec = interval;
+    if (timerfd_settime(t->fd, 0, &its, NULL) != 0)
+    {
+        LOGGER(LOG_ERR, "Failed to set timer: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static void ticker_append(ticker_t* t);
+
+void ticker_expired(ticker_t* t)
+{
+    uint64_t cnt;
+    ssize_t sz = read(t->fd, &cnt, sizeof(cnt));
+    if (sz < 0)
+    {
+        if (errno != EAGAIN && errno != EINTR)
+        {
+            LOGGER(LOG_ERR, "Could not read timer: %s", strerror(errno));
+        }
+        return;
+    }
+    ticker_append(t);
+}
+
+static void ticker_append(ticker_t* t)
+{
+    if (__atomic_load_n(&t->busy, __ATOMIC_ACQUIRE))
+    {
+        LOGGER(LOG_INFO, "Previous timestamp still being written, skipping one");
+        return;
+    }
+
+    time_t now = time(NULL);
+    struct tm tm;
+    if (!localtime_r(&now, &tm))
+    {
+        LOGGER(LOG_ERR, "Error getting time");
+        return;
+    }
+    strcpy(t->buf, TICKER_PREFIX);
+    size_t len = strftime(t->buf + strlen(TICKER_PREFIX), sizeof(t->buf) - strlen(TICKER_PREFIX),
+                          "%a, %d %b %Y %T %z\n", &tm);
+    if (len == 0)
+    {
+        LOGGER(LOG_ERR, "Error strftime");
+        return;
+    }
+    len += strlen(TICKER_PREFIX);
+    LOGGER(LOG_DEBUG, "Writing %zu characters: %s to file", len, t->buf);
+
+    // the writer owns the request until ticker_written clears busy
+    t->busy = true;
+    t->req.buf = t->buf;
+    t->req.len = len;
+    pstore_submit(t->store, &t->req);
+}
+
+void ticker_destroy(ticker_t* t)
+{
+    if (t->fd >= 0)
+    {
+        close(t->fd);
+        t->fd = -1;
+    }
+}
@@ -0,0 +1,52 @@
+#ifndef TICKER_H
+#define TICKER_H
+
+#include <stdbool.h>
+#include "packet_store.h"
+
+#define TICKER_INTERVAL_SEC 10
+#define TICKER_RECORD_SIZE  200
+
+/**
+ * Appends a timestamp record to the store at a fixed interval. A timerfd
+ * drives it, which the connection engine watches in its own event loop, so
+ * nothing runs on a thread of its own. The record is submitted to the store
+ * writer like a client packet and is written in the same batches. A tick that
+ * comes while the previous record is still being written is skipped.
+ */
+typedef struct ticker_s ticker_t;
+struct ticker_s {
+    int fd;
+    pstore_t* store;
+    pstore_req_t req;
+    bool busy;
+    char buf[TICKER_RECORD_SIZE];
+};
+
+/**
+* Start a timer that expires every @param interval seconds, the first time
+* one interval from now.
+* @return 0 on success, -1 on error.
+*/
+int ticker_init(ticker_t* t, pstore_t* store, int interval);
+
+/**
+* Expire every @param interval seconds from now on, the engine keeps watching
+* the same descriptor.
+* @return 0 on success, -1 on error.
+*/
+int ticker_interval(ticker_t* t, int interval);
+
+/**
+* Consume the expirations of the non-blocking timerfd and append a record if
+* there were any. Called whenever the engine sees the descriptor readable.
+*/
+void ticker_expired(ticker_t* t);
+
+/**
+* Stop the timer. The store must have been destroyed already, so no record
+* is still being written.
+*/
+void ticker_destroy(ticker_t* t);
+
+#endif
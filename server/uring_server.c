@@ -0,0 +1,1178 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <netdb.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "aesdsocket.h"
+#include "arena.h"
+#include "framer.h"
+#include "logger.h"
+#include "metrics.h"
+#include "outq.h"
+#include "protocol.h"
+#include "queue.h"
+#include "uring_server.h"
+
+#define UR_ENTRIES      1024
+#define UR_NBUFS        256
+#define UR_BUFSZ        0x1000
+#define UR_BGID         1
+#define UR_IOV          16
+#define UR_TICK_SEC     1
+
+/*
+ * The operation is kept in the low bits of the cqe user_data, the rest is
+ * the owning connection, the listener index shifted by UR_OP_SHIFT for
+ * accepts, or 0 for other server wide operations.
+ */
+enum ur_op {
+    UR_OP_ACCEPT = 1,
+    UR_OP_RECV,
+    UR_OP_SEND,
+    UR_OP_CLOSE,
+    UR_OP_PROVIDE,
+    UR_OP_TIMEOUT,
+    UR_OP_WAKE,
+    UR_OP_TICK,
+    UR_OP_SIGNAL,
+    UR_OP_WRITABLE,
+    UR_OP_CANCEL,
+};
+#define UR_OP_MASK 0xfULL
+#define UR_OP_SHIFT 4
+
+typedef struct ur_ring_s ur_ring_t;
+struct ur_ring_s {
+    int fd;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned tail;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* map;
+    size_t map_sz;
+    size_t sqes_sz;
+};
+
+typedef struct ur_server_s ur_server_t;
+
+typedef struct ur_conn_s ur_conn_t;
+struct ur_conn_s {
+    arena_t* arena;
+    int fd;
+    ur_server_t* s;
+    bool closing;
+    bool eof;
+    bool sub;
+    bool recving;
+    bool sending;
+    bool pinned;
+    bool queued;
+    bool committing;
+    size_t served;
+    framer_t in;
+    outq_t out;
+    size_t off;
+    size_t end;
+    pstore_t* store;
+    pstore_t* req_store;
+    struct iovec iov[UR_IOV];
+    struct msghdr msg;
+    pstore_req_t req;
+    metrics_conn_t met;
+    ur_conn_t* next_done;
+    char peer[INET6_ADDRSTRLEN];
+    LIST_ENTRY(ur_conn_s) entries;
+    LIST_ENTRY(ur_conn_s) sub_entries;
+};
+
+/*
+ * A connection has at most one receive and one send in flight, replies go out
+ * from its output queue in packet order while later packets are received.
+ * Packets go to the store's writer thread without an operation in flight on
+ * their connection. The writer pushes finished connections onto done and bumps
+ * the wfd eventfd, which the ring keeps a read posted on. ops counts the
+ * operations the kernel has not completed yet. While there are
+ * subscribers of a channel its store is watched too, every batch then bumps
+ * wfd once and the subscribers not already sending are handed the new bytes.
+ * A connection sends and subscribes on its channel, store, while req_store is
+ * the channel of the packet committing. Watches are kept by channel index.
+ */
+struct ur_server_s {
+    ur_ring_t ring;
+    const lsn_set_t* lsn;
+    chan_set_t* chans;
+    int wfd;
+    uint64_t wval;
+    ticker_t* ticker;
+    sigs_t* sigs;
+    bool draining;
+    bool stopped;
+    ur_conn_t* done;
+    int inflight;
+    int ops;
+    bool multishot;
+    char* pool;
+    struct __kernel_timespec tick;
+    struct __kernel_timespec drain;
+    pstore_watch_t watches[CHAN_MAX];
+    int nsubs[CHAN_MAX];
+    LIST_HEAD(ur_connhead, ur_conn_s) conns;
+    LIST_HEAD(ur_subhead, ur_conn_s) subs;
+};
+
+static int ur_setup(ur_ring_t* r, unsigned entries)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0)
+    {
+        return -1;
+    }
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP))
+    {
+        close(r->fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    size_t sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->map_sz = (sq_sz > cq_sz) ? sq_sz : cq_sz;
+    r->map = mmap(NULL, r->map_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  r->fd, IORING_OFF_SQ_RING);
+    if (r->map == MAP_FAILED)
+    {
+        close(r->fd);
+        return -1;
+    }
+    r->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED)
+    {
+        munmap(r->map, r->map_sz);
+        close(r->fd);
+        return -1;
+    }
+
+    char* base = r->map;
+    r->sq_head = (unsigned*)(base + p.sq_off.head);
+    r->sq_tail = (unsigned*)(base + p.sq_off.tail);
+    r->sq_array = (unsigned*)(base + p.sq_off.array);
+    r->sq_mask = *(unsigned*)(base + p.sq_off.ring_mask);
+    r->sq_entries = p.sq_entries;
+    r->tail = *r->sq_tail;
+    r->cq_head = (unsigned*)(base + p.cq_off.head);
+    r->cq_tail = (unsigned*)(base + p.cq_off.tail);
+    r->cq_mask = *(unsigned*)(base + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)(base + p.cq_off.cqes);
+    return 0;
+}
+
+static void ur_teardown(ur_ring_t* r)
+{
+    munmap(r->sqes, r->sqes_sz);
+    munmap(r->map, r->map_sz);
+    close(r->fd);
+}
+
+static bool ur_probe(ur_ring_t* r)
+{
+    static const uint8_t needed[] = {
+        IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_CLOSE,
+        IORING_OP_PROVIDE_BUFFERS, IORING_OP_TIMEOUT, IORING_OP_READ,
+        IORING_OP_POLL_ADD, IORING_OP_ASYNC_CANCEL, IORING_OP_TIMEOUT_REMOVE,
+    };
+    bool ok = false;
+    size_t sz = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = calloc(1, sz);
+
+    if (probe && syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PROBE, probe, 256) == 0)
+    {
+        ok = true;
+        for (size_t i = 0; i < sizeof(needed); i++)
+        {
+            if (needed[i] > probe->last_op || !(probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED))
+            {
+                LOGGER(LOG_INFO, "io_uring op %d not supported", needed[i]);
+                ok = false;
+            }
+        }
+    }
+    free(probe);
+    return ok;
+}
+
+/**
+ * Publish queued sqes and optionally wait for @param wait_nr completions.
+ * @return 0 on success (including interruption), -1 on error.
+ */
+static int ur_enter(ur_ring_t* r, unsigned wait_nr)
+{
+    __atomic_store_n(r->sq_tail, r->tail, __ATOMIC_RELEASE);
+    unsigned to_submit = r->tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if (syscall(__NR_io_uring_enter, r->fd, to_submit, wait_nr,
+                wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0) < 0)
+    {
+        if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+        {
+            return 0;
+        }
+        LOGGER(LOG_ERR, "io_uring_enter failed: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static struct io_uring_sqe* ur_get_sqe(ur_ring_t* r)
+{
+    if (r->tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries)
+    {
+        // ring is full, hand what we have to the kernel first
+        if (ur_enter(r, 0) != 0 ||
+            r->tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries)
+        {
+            return NULL;
+        }
+    }
+    unsigned idx = r->tail & r->sq_mask;
+    struct io_uring_sqe* sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    r->sq_array[idx] = idx;
+    r->tail++;
+    return sqe;
+}
+
+static struct io_uring_sqe* ur_prep(ur_server_t* s, uint8_t opcode, int fd, ur_conn_t* conn, enum ur_op op)
+{
+    struct io_uring_sqe* sqe = ur_get_sqe(&s->ring);
+    if (!sqe)
+    {
+        LOGGER(LOG_ERR, "No free io_uring submission entries");
+        return NULL;
+    }
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = (uint64_t)(uintptr_t)conn | op;
+    s->ops++;
+    return sqe;
+}
+
+/* cancel the operation in flight with user_data @param data, timeouts are removed */
+static void ur_cancel(ur_server_t* s, uint8_t opcode, uint64_t data)
+{
+    struct io_uring_sqe* sqe = ur_prep(s, opcode, -1, NULL, UR_OP_CANCEL);
+    if (sqe)
+    {
+        sqe->addr = data;
+    }
+}
+
+/* the user_data of the accept armed on listener @param lsn */
+static uint64_t ur_accept_data(int lsn)
+{
+    return ((uint64_t)lsn << UR_OP_SHIFT) | UR_OP_ACCEPT;
+}
+
+static void ur_arm_accept(ur_server_t* s, int lsn)
+{
+    ur_conn_t* tag = (ur_conn_t*)(uintptr_t)(ur_accept_data(lsn) & ~UR_OP_MASK);
+    struct io_uring_sqe* sqe = ur_prep(s, IORING_OP_ACCEPT, s->lsn->fds[lsn], tag, UR_OP_ACCEPT);
+    if (sqe)
+    {
+        sqe->accept_flags = SOCK_CLOEXEC;
+        sqe->ioprio = s->multishot ? IORING_ACCEPT_MULTISHOT : 0;
+    }
+}
+
+static void ur_arm_timeout(ur_server_t* s, struct __kernel_timespec* ts)
+{
+    struct io_uring_sqe* sqe = ur_prep(s, IORING_OP_TIMEOUT, -1, NULL, UR_OP_TIMEOUT);
+    if (sqe)
+    {
+        sqe->addr = (uintptr_t)ts;
+        sqe->len = 1;
+    }
+}
+
+static void ur_arm_wake(ur_server_t* s)
+{
+    struct io_uring_sqe* sqe = ur_prep(s, IORING_OP_READ, s->wfd, NULL, UR_OP_WAKE);
+    if (sqe)
+    {
+        sqe->addr = (uintptr_t)&s->wval;
+        sqe->len = sizeof(s->wval);
+    }
+}
+
+/* the timerfd is non-blocking, so wait for it to expire before reading it */
+static void ur_arm_tick(ur_server_t* s)
+{
+    struct io_uring_sqe* sqe = ur_prep(s, IORING_OP_POLL_ADD, s->ticker->fd, NULL, UR_OP_TICK);
+    if (sqe)
+    {
+        sqe->poll32_events = POLLIN;
+    }
+}
+
+static void ur_arm_signals(ur_server_t* s)
+{
+    struct io_uring_sqe* sqe = ur_prep(s, IORING_OP_POLL_ADD, s->sigs->fd, NULL, UR_OP_SIGNAL);
+    if (sqe)
+    {
+        sqe->poll32_events = POLLIN;
+    }
+}
+
+static void ur_provide(ur_server_t* s, int bid, int nbufs)
+{
+    struct io_uring_sqe* sqe = ur_prep(s, IORING_OP_PROVIDE_BUFFERS, nbufs, NULL, UR_OP_PROVIDE);
+    if (sqe)
+    {
+        sqe->addr = (uintptr_t)(s->pool + (size_t)bid * UR_BUFSZ);
+        sqe->len = UR_BUFSZ;
+        sqe->off = bid;
+        sqe->buf_group = UR_BGID;
+    }
+}
+
+static void ur_unsubscribe(ur_server_t* s, ur_conn_t* conn)
+{
+    if (conn->sub)
+    {
+        int chan = chan_index(s->chans, conn->store);
+        conn->sub = false;
+        LIST_REMOVE(conn, sub_entries);
+        if (--s->nsubs[chan] == 0)
+        {
+            pstore_unwatch(conn->store, &s->watches[chan]);
+        }
+        metrics_add(METRICS_UNSUBSCRIBED, 1);
+    }
+}
+
+/* close the socket once no operation of the connection is in flight */
+static void ur_finish(ur_server_t* s, ur_conn_t* conn)
+{
+    if (conn->recving || conn->sending || conn->committing)
+    {
+        return;
+    }
+    if (!ur_prep(s, IORING_OP_CLOSE, conn->fd, conn, UR_OP_CLOSE))
+    {
+        close(conn->fd);
+        metrics_closed(&conn->met);
+        LIST_REMOVE(conn, entries);
+        framer_free(&conn->in);
+        arena_destroy(conn->arena);
+    }
+}
+
+static void ur_close(ur_server_t* s, ur_conn_t* conn)
+{
+    if (conn->closing)
+    {
+        return;
+    }
+    conn->closing = true;
+    ur_unsubscribe(s, conn);
+    if (conn->recving || conn->sending)
+    {
+        // fail the operations in flight, the last one to complete closes
+        shutdown(conn->fd, SHUT_RDWR);
+    }
+    ur_finish(s, conn);
+}
+
+static void ur_arm_recv(ur_server_t* s, ur_conn_t* conn)
+{
+    struct io_uring_sqe* sqe = ur_prep(s, IORING_OP_RECV, conn->fd, conn, UR_OP_RECV);
+    if (!sqe)
+    {
+        ur_close(s, conn);
+        return;
+    }
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = UR_BGID;
+    sqe->len = UR_BUFSZ;
+    conn->recving = true;
+}
+
+static void ur_progress(ur_server_t* s, ur_conn_t* conn);
+
+/* the log offset the send in flight started at, in *store */
+static size_t* ur_send_off(ur_conn_t* conn, pstore_t** store)
+{
+    if (conn->queued)
+    {
+        outq_range_t* r = outq_front(&conn->out);
+        *store = r->store;
+        return &r->off;
+    }
+    *store = conn->store;
+    return &conn->off;
+}
+
+/*
+ * Send the next run of store bytes of the front queued reply or, once the
+ * queue is sent, of the log a subscriber was not sent yet. The iovecs point
+ * straight into the store so no replay copy is made, and pin it until the
+ * send completes. A subscriber that caught up stays idle until the store
+ * watch reports the next batch.
+ */
+static void ur_send(ur_server_t* s, ur_conn_t* conn)
+{
+    outq_range_t* r;
+    int cnt = 0;
+
+    while (cnt == 0 && (r = outq_front(&conn->out)) != NULL)
+    {
+        size_t from = r->off;
+        cnt = pstore_iov(r->store, &r->off, r->end, conn->iov, UR_IOV);
+        // counts bytes retention dropped as sent, completing a reply dropped entirely
+        outq_sent(&conn->out, from);
+        if (cnt == 0 && r->off < r->end)
+        {
+            ur_close(s, conn);
+            return;
+        }
+    }
+    conn->queued = cnt > 0;
+    if (cnt == 0 && conn->sub)
+    {
+        if (conn->off >= conn->end && proto_tail(conn->store, &conn->off, &conn->end) != 0)
+        {
+            ur_close(s, conn);
+            return;
+        }
+        if (conn->off < conn->end)
+        {
+            cnt = pstore_iov(conn->store, &conn->off, conn->end, conn->iov, UR_IOV);
+            if (cnt == 0 && conn->off < conn->end)
+            {
+                ur_close(s, conn);
+                return;
+            }
+        }
+    }
+    if (cnt == 0)
+    {
+        return;
+    }
+    pstore_t* store;
+    size_t* off = ur_send_off(conn, &store);
+    struct io_uring_sqe* sqe = ur_prep(s, IORING_OP_SENDMSG, conn->fd, conn, UR_OP_SEND);
+    if (!sqe)
+    {
+        pstore_iov_done(store, *off, cnt);
+        ur_close(s, conn);
+        return;
+    }
+    memset(&conn->msg, 0, sizeof(conn->msg));
+    conn->msg.msg_iov = conn->iov;
+    conn->msg.msg_iovlen = cnt;
+    sqe->addr = (uintptr_t)&conn->msg;
+    sqe->len = 1;
+    // the writer of a ring waits for the pin, so the send must not park in the kernel
+    sqe->msg_flags = MSG_NOSIGNAL | (pstore_is_ring(store) ? MSG_DONTWAIT : 0);
+    conn->sending = true;
+    conn->pinned = true;
+}
+
+/* a ring send found the socket full, wait for room without holding a pin */
+static void ur_arm_writable(ur_server_t* s, ur_conn_t* conn)
+{
+    struct io_uring_sqe* sqe = ur_prep(s, IORING_OP_POLL_ADD, conn->fd, conn, UR_OP_WRITABLE);
+    if (!sqe)
+    {
+        ur_close(s, conn);
+        return;
+    }
+    sqe->poll32_events = POLLOUT;
+    conn->sending = true;
+}
+
+/* subscribers are never read from again, the store watch drives them */
+static void ur_subscribe(ur_server_t* s, ur_conn_t* conn)
+{
+    LOGGER(LOG_INFO, "%s subscribed at offset %zu", conn->peer, conn->off);
+    metrics_add(METRICS_SUBSCRIBED, 1);
+    framer_free(&conn->in);
+    conn->sub = true;
+    LIST_INSERT_HEAD(&s->subs, conn, sub_entries);
+    int chan = chan_index(s->chans, conn->store);
+    if (s->nsubs[chan]++ == 0)
+    {
+        pstore_watch(conn->store, &s->watches[chan]);
+    }
+}
+
+static void ur_wake(int wfd)
+{
+    uint64_t one = 1;
+    if (write(wfd, &one, sizeof(one)) < 0)
+    {
+        LOGGER(LOG_ERR, "Could not wake io_uring engine: %s", strerror(errno));
+    }
+}
+
+/* called on the store writer thread */
+static void ur_notify(pstore_watch_t* watch)
+{
+    ur_wake(((ur_server_t*)watch->arg)->wfd);
+}
+
+/* called on the store writer thread */
+static void ur_committed(pstore_req_t* req)
+{
+    ur_conn_t* conn = (ur_conn_t*)req->arg;
+    ur_server_t* s = conn->s;
+
+    conn->next_done = __atomic_load_n(&s->done, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&s->done, &conn->next_done, conn, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+    ur_wake(s->wfd);
+}
+
+/*
+ * The reply is queued once the batch of @param store holding the packet was
+ * written. The packet stays in the framer buffer, nothing is received before
+ * then.
+ */
+static void ur_commit(ur_server_t* s, ur_conn_t* conn, pstore_t* store, const char* pkt, size_t len)
+{
+    memset(&conn->req, 0, sizeof(conn->req));
+    conn->req.buf = pkt;
+    conn->req.len = len;
+    conn->req.complete = ur_committed;
+    conn->req.arg = conn;
+    conn->req_store = store;
+    conn->committing = true;
+    s->inflight++;
+    metrics_append_start(&conn->met);
+    pstore_submit(store, &conn->req);
+}
+
+/* take the connections whose packets the writer completed */
+static ur_conn_t* ur_take_committed(ur_server_t* s)
+{
+    ur_conn_t* conn = __atomic_exchange_n(&s->done, NULL, __ATOMIC_ACQUIRE);
+    for (ur_conn_t* c = conn; c; c = c->next_done)
+    {
+        s->inflight--;
+    }
+    return conn;
+}
+
+static void ur_on_wake(ur_server_t* s, int res)
+{
+    if (res < 0 && res != -ECANCELED)
+    {
+        LOGGER(LOG_ERR, "Could not read io_uring engine wakeup: %s", strerror(-res));
+    }
+    if ((run || s->draining) && !s->stopped)
+    {
+        ur_arm_wake(s);
+    }
+
+    ur_conn_t* conn = ur_take_committed(s);
+    while (conn)
+    {
+        ur_conn_t* next = conn->next_done;
+        conn->committing = false;
+        if (conn->closing)
+        {
+            ur_finish(s, conn);
+        }
+        else if (conn->req.rc != 0)
+        {
+            ur_close(s, conn);
+        }
+        else
+        {
+            metrics_appended(&conn->met);
+            outq_push(&conn->out, conn->req_store, 0, conn->req.end);
+            ur_progress(s, conn);
+        }
+        conn = next;
+    }
+
+    ur_conn_t* tmp;
+    LIST_FOREACH_SAFE(conn, &s->subs, sub_entries, tmp)
+    {
+        if (!conn->sending && !conn->closing)
+        {
+            ur_send(s, conn);
+        }
+    }
+}
+
+/*
+ * Keep a send going while replies are queued and answer buffered packets until
+ * the connection has to wait for the writer, the socket or more data. Nothing
+ * is received while a packet is committing or the queue is over its high
+ * watermark.
+ */
+static void ur_progress(ur_server_t* s, ur_conn_t* conn)
+{
+    for (;;)
+    {
+        const char* pkt;
+        size_t len;
+        size_t off, end;
+        pstore_t* store;
+
+        if (!conn->sending)
+        {
+            ur_send(s, conn);
+        }
+        if (conn->closing || conn->sub || conn->committing || outq_paused(&conn->out))
+        {
+            return;
+        }
+        if (!framer_next(&conn->in, &pkt, &len))
+        {
+            if (!conn->eof)
+            {
+                if (!run && !framer_pending(&conn->in) && !conn->sending)
+                {
+                    // shutting down and between packets
+                    ur_close(s, conn);
+                }
+                else if (!conn->recving)
+                {
+                    framer_release(&conn->in);
+                    ur_arm_recv(s, conn);
+                }
+                return;
+            }
+            // peer finished sending, store what is left of an unterminated packet
+            len = framer_rest(&conn->in, &pkt);
+            if (len == 0 && conn->served > 0)
+            {
+                // close once the last replies are out
+                if (!conn->sending)
+                {
+                    ur_close(s, conn);
+                }
+                return;
+            }
+        }
+        metrics_packet(&conn->met, framer_pending(&conn->in));
+        conn->served++;
+        store = conn->store;
+        switch (proto_command(&store, &pkt, &len, &off, &end))
+        {
+        case PROTO_DATA:
+            ur_commit(s, conn, store, pkt, len);
+            return;
+        case PROTO_SUBSCRIBE:
+            conn->store = store;
+            conn->off = off;
+            conn->end = end;
+            ur_subscribe(s, conn);
+            break;
+        case PROTO_CHANNEL:
+            conn->store = store;
+            outq_push(&conn->out, store, off, end);
+            break;
+        case PROTO_REPLY:
+            outq_push(&conn->out, store, off, end);
+            break;
+        }
+    }
+}
+
+static void ur_on_accept(ur_server_t* s, int lsn, int res, unsigned flags)
+{
+    if (!(flags & IORING_CQE_F_MORE) && run && !s->stopped)
+    {
+        if (res == -EINVAL && s->multishot)
+        {
+            LOGGER(LOG_INFO, "Multishot accept not supported, re-arming single accepts");
+            s->multishot = false;
+        }
+        ur_arm_accept(s, lsn);
+    }
+    if (res < 0)
+    {
+        if (res != -EINVAL && res != -ECONNABORTED && res != -EINTR && res != -ECANCELED)
+        {
+            LOGGER(LOG_ERR, "Error accepting connection: %s", strerror(-res));
+        }
+        return;
+    }
+    if (!run || s->stopped)
+    {
+        // accepted before the cancellation got to it
+        close(res);
+        return;
+    }
+
+    arena_t* arena = arena_create();
+    ur_conn_t* conn = arena ? arena_alloc(arena, sizeof(ur_conn_t)) : NULL;
+    if (!conn)
+    {
+        LOGGER(LOG_ERR, "Could not allocate memory for connection");
+        if (arena)
+        {
+            arena_destroy(arena);
+        }
+        close(res);
+        return;
+    }
+    conn->arena = arena;
+    conn->fd = res;
+    conn->s = s;
+    // channel 0 is the default one
+    conn->store = s->chans->stores[0];
+    framer_init(&conn->in);
+    outq_init(&conn->out);
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    if (getpeername(res, (struct sockaddr*)&addr, &addrlen) != 0 ||
+        getnameinfo((struct sockaddr*)&addr, addrlen, conn->peer, sizeof(conn->peer),
+                    NULL, 0, NI_NUMERICHOST) != 0)
+    {
+        strcpy(conn->peer, "unknown");
+    }
+    LIST_INSERT_HEAD(&s->conns, conn, entries);
+    metrics_accepted(&conn->met);
+    LOGGER(LOG_INFO, "Accepted connection from %s", conn->peer);
+    ur_arm_recv(s, conn);
+}
+
+static void ur_on_recv(ur_server_t* s, ur_conn_t* conn, int res, unsigned flags)
+{
+    conn->recving = false;
+    if (conn->closing)
+    {
+        if (flags & IORING_CQE_F_BUFFER)
+        {
+            ur_provide(s, flags >> IORING_CQE_BUFFER_SHIFT, 1);
+        }
+        ur_finish(s, conn);
+        return;
+    }
+    if (res == -ENOBUFS)
+    {
+        // pool drained within this batch, buffers are handed back below
+        ur_arm_recv(s, conn);
+        return;
+    }
+    if (res < 0)
+    {
+        LOGGER(LOG_ERR, "Error while waiting for receive data: %s", strerror(-res));
+        ur_close(s, conn);
+        return;
+    }
+
+    if (res == 0)
+    {
+        conn->eof = true;
+    }
+    else
+    {
+        int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        size_t avail;
+        char* space = framer_space(&conn->in, res, &avail);
+        if (space && avail < (size_t)res)
+        {
+            // the buffer hit its limit within this receive
+            space = NULL;
+            errno = EMSGSIZE;
+        }
+        if (!space)
+        {
+            LOGGER(LOG_ERR, "Could not grow receive buffer of %s: %s", conn->peer, strerror(errno));
+            ur_provide(s, bid, 1);
+            ur_close(s, conn);
+            return;
+        }
+        memcpy(space, s->pool + (size_t)bid * UR_BUFSZ, res);
+        framer_fill(&conn->in, res);
+        metrics_received(&conn->met, res);
+        ur_provide(s, bid, 1);
+    }
+    ur_progress(s, conn);
+}
+
+static void ur_on_send(ur_server_t* s, ur_conn_t* conn, int res)
+{
+    pstore_t* store;
+    size_t* off = ur_send_off(conn, &store);
+    conn->sending = false;
+    conn->pinned = false;
+    pstore_iov_done(store, *off, conn->msg.msg_iovlen);
+    if (conn->closing)
+    {
+        ur_finish(s, conn);
+        return;
+    }
+    if (res == -EAGAIN)
+    {
+        ur_arm_writable(s, conn);
+        return;
+    }
+    if (res < 0)
+    {
+        LOGGER(LOG_ERR, "Error sending to %s: %s", conn->peer, strerror(-res));
+        ur_close(s, conn);
+        return;
+    }
+    size_t from = *off;
+    *off += res;
+    if (conn->queued)
+    {
+        outq_sent(&conn->out, from);
+    }
+    else
+    {
+        metrics_add(METRICS_REPLY_BYTES, res);
+    }
+    ur_progress(s, conn);
+}
+
+static void ur_on_close(ur_conn_t* conn)
+{
+    LIST_REMOVE(conn, entries);
+    metrics_closed(&conn->met);
+    LOGGER(LOG_INFO, "Closed connection from %s", conn->peer);
+    framer_free(&conn->in);
+    arena_destroy(conn->arena);
+}
+
+static void ur_complete(ur_server_t* s, uint64_t data, int res, unsigned flags)
+{
+    ur_conn_t* conn = (ur_conn_t*)(uintptr_t)(data & ~UR_OP_MASK);
+
+    switch (data & UR_OP_MASK)
+    {
+    case UR_OP_ACCEPT:
+        ur_on_accept(s, data >> UR_OP_SHIFT, res, flags);
+        break;
+    case UR_OP_RECV:
+        ur_on_recv(s, conn, res, flags);
+        break;
+    case UR_OP_SEND:
+        ur_on_send(s, conn, res);
+        break;
+    case UR_OP_CLOSE:
+        ur_on_close(conn);
+        break;
+    case UR_OP_WRITABLE:
+        conn->sending = false;
+        if (conn->closing)
+        {
+            ur_finish(s, conn);
+        }
+        else
+        {
+            ur_progress(s, conn);
+        }
+        break;
+    case UR_OP_PROVIDE:
+        if (res < 0)
+        {
+            LOGGER(LOG_ERR, "Could not provide receive buffers: %s", strerror(-res));
+        }
+        break;
+    case UR_OP_TIMEOUT:
+        if ((run || s->draining) && !s->stopped)
+        {
+            ur_arm_timeout(s, &s->tick);
+        }
+        break;
+    case UR_OP_WAKE:
+        ur_on_wake(s, res);
+        break;
+    case UR_OP_TICK:
+        if (res == -ECANCELED)
+        {
+            break;
+        }
+        if (res < 0)
+        {
+            LOGGER(LOG_ERR, "Could not poll timer, no more timestamps: %s", strerror(-res));
+            break;
+        }
+        ticker_expired(s->ticker);
+        if (run && !s->stopped)
+        {
+            ur_arm_tick(s);
+        }
+        break;
+    case UR_OP_SIGNAL:
+        if (res == -ECANCELED)
+        {
+            break;
+        }
+        if (res < 0)
+        {
+            LOGGER(LOG_ERR, "Could not poll signalfd: %s", strerror(-res));
+            sigs_stop(s->sigs);
+            break;
+        }
+        sigs_read(s->sigs);
+        if (run && !s->stopped)
+        {
+            ur_arm_signals(s);
+        }
+        break;
+    }
+}
+
+static void ur_reap(ur_server_t* s)
+{
+    ur_ring_t* r = &s->ring;
+    unsigned head = *r->cq_head;
+
+    while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        struct io_uring_cqe* cqe = &r->cqes[head & r->cq_mask];
+        uint64_t data = cqe->user_data;
+        int res = cqe->res;
+        unsigned flags = cqe->flags;
+        head++;
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+        if (!(flags & IORING_CQE_F_MORE))
+        {
+            s->ops--;
+        }
+        ur_complete(s, data, res, flags);
+    }
+}
+
+/*
+ * Stop accepting and close every connection that is between packets and every
+ * subscriber, the others are closed as soon as they get there. A timeout wakes
+ * the loop at the deadline.
+ */
+static void ur_drain(ur_server_t* s)
+{
+    ur_conn_t* conn;
+    ur_conn_t* tmp;
+
+    s->draining = true;
+    for (int i = 0; i < s->lsn->count; i++)
+    {
+        ur_cancel(s, IORING_OP_ASYNC_CANCEL, ur_accept_data(i));
+    }
+    int ms = sigs_drain_ms(s->sigs);
+    s->drain.tv_sec = ms / 1000;
+    s->drain.tv_nsec = (ms % 1000) * 1000000L;
+    ur_arm_timeout(s, &s->drain);
+    LIST_FOREACH_SAFE(conn, &s->conns, entries, tmp)
+    {
+        if (conn->sub)
+        {
+            ur_close(s, conn);
+        }
+        else if (!conn->closing)
+        {
+            ur_progress(s, conn);
+        }
+    }
+}
+
+/*
+ * Shut every connection down and cancel the server wide operations, then reap
+ * until the kernel completed every operation. Closing a socket does not cancel
+ * what is in flight on it, the ring holds its own reference, so only then is
+ * nothing left that could still receive into the buffer pool or send from a
+ * connection. Connections still committing keep their socket, their packet is
+ * with the writer.
+ * @return 0 once nothing is in flight, -1 if the ring failed first.
+ */
+static int ur_stop(ur_server_t* s)
+{
+    ur_conn_t* conn;
+    ur_conn_t* tmp;
+
+    s->stopped = true;
+    LIST_FOREACH_SAFE(conn, &s->conns, entries, tmp)
+    {
+        ur_close(s, conn);
+    }
+    if (!s->draining)
+    {
+        // ur_drain cancelled them already
+        for (int i = 0; i < s->lsn->count; i++)
+        {
+            ur_cancel(s, IORING_OP_ASYNC_CANCEL, ur_accept_data(i));
+        }
+    }
+    ur_cancel(s, IORING_OP_ASYNC_CANCEL, UR_OP_WAKE);
+    ur_cancel(s, IORING_OP_ASYNC_CANCEL, UR_OP_TICK);
+    ur_cancel(s, IORING_OP_ASYNC_CANCEL, UR_OP_SIGNAL);
+    // the tick and, while draining, the drain deadline share their user_data
+    ur_cancel(s, IORING_OP_TIMEOUT_REMOVE, UR_OP_TIMEOUT);
+    ur_cancel(s, IORING_OP_TIMEOUT_REMOVE, UR_OP_TIMEOUT);
+
+    while (s->ops > 0)
+    {
+        if (ur_enter(&s->ring, 1) != 0)
+        {
+            return -1;
+        }
+        ur_reap(s);
+    }
+    return 0;
+}
+
+int uring_server_run(const lsn_set_t* lsn, chan_set_t* chans, ticker_t* tick, sigs_t* sigs)
+{
+    int rc = -1;
+    ur_server_t s;
+
+    memset(&s, 0, sizeof(s));
+    s.lsn = lsn;
+    s.chans = chans;
+    s.ticker = tick;
+    s.sigs = sigs;
+    s.wfd = -1;
+    s.multishot = true;
+    s.tick.tv_sec = UR_TICK_SEC;
+    for (int c = 0; c < CHAN_MAX; c++)
+    {
+        s.watches[c].notify = ur_notify;
+        s.watches[c].arg = &s;
+    }
+    LIST_INIT(&s.conns);
+    LIST_INIT(&s.subs);
+
+    if (ur_setup(&s.ring, UR_ENTRIES) != 0)
+    {
+        LOGGER(LOG_INFO, "io_uring unavailable: %s", strerror(errno));
+        return URING_UNSUPPORTED;
+    }
+    if (!ur_probe(&s.ring))
+    {
+        ur_teardown(&s.ring);
+        return URING_UNSUPPORTED;
+    }
+
+    s.pool = malloc((size_t)UR_NBUFS * UR_BUFSZ);
+    if (!s.pool)
+    {
+        LOGGER(LOG_ERR, "Could not allocate receive buffer pool");
+        goto error;
+    }
+    s.wfd = eventfd(0, EFD_CLOEXEC);
+    if (s.wfd < 0)
+    {
+        LOGGER(LOG_ERR, "Could not create io_uring engine eventfd: %s", strerror(errno));
+        goto error;
+    }
+
+    ur_provide(&s, 0, UR_NBUFS);
+    ur_arm_wake(&s);
+    ur_arm_tick(&s);
+    ur_arm_signals(&s);
+    for (int i = 0; i < lsn->count; i++)
+    {
+        ur_arm_accept(&s, i);
+    }
+    ur_arm_timeout(&s, &s.tick);
+    LOGGER(LOG_INFO, "Started io_uring engine");
+
+    rc = 0;
+    for (;;)
+    {
+        if (!run && !s.draining)
+        {
+            ur_drain(&s);
+        }
+        if (s.draining && (LIST_EMPTY(&s.conns) || sigs_drain_ms(sigs) == 0))
+        {
+            break;
+        }
+        if (ur_enter(&s.ring, 1) != 0)
+        {
+            rc = -1;
+            break;
+        }
+        ur_reap(&s);
+    }
+
+    if (ur_stop(&s) != 0)
+    {
+        LOGGER(LOG_ERR, "Could not complete io_uring operations before teardown");
+        rc = -1;
+    }
+
+error:
+    ur_teardown(&s.ring);
+    for (int c = 0; c < CHAN_MAX; c++)
+    {
+        if (s.nsubs[c] > 0)
+        {
+            pstore_unwatch(chans->stores[c], &s.watches[c]);
+        }
+    }
+    // a send the ring failed to complete never got to ur_on_send, and a ring
+    // writer evicting what it pins would never finish the commits waited for below
+    ur_conn_t* conn;
+    LIST_FOREACH(conn, &s.conns, entries)
+    {
+        if (conn->pinned)
+        {
+            pstore_t* store;
+            size_t* off = ur_send_off(conn, &store);
+            pstore_iov_done(store, *off, conn->msg.msg_iovlen);
+            conn->pinned = false;
+        }
+    }
+    // the writer still holds the packets of committing connections
+    while (s.inflight > 0)
+    {
+        if (read(s.wfd, &s.wval, sizeof(s.wval)) < 0 && errno != EINTR)
+        {
+            LOGGER(LOG_ERR, "Could not read io_uring engine wakeup: %s", strerror(errno));
+            break;
+        }
+        ur_take_committed(&s);
+    }
+    if (s.wfd >= 0)
+    {
+        // the writers complete batches in order, so once an empty append
+        // returns on every channel no completion can still be touching the engine
+        chan_barrier(chans);
+        close(s.wfd);
+    }
+    while (!LIST_EMPTY(&s.conns))
+    {
+        conn = LIST_FIRST(&s.conns);
+        LIST_REMOVE(conn, entries);
+        if (conn->committing)
+        {
+            // never got to ur_finish, so its socket is still open
+            close(conn->fd);
+        }
+        framer_free(&conn->in);
+        arena_destroy(conn->arena);
+    }
+    free(s.pool);
+    return rc;
+}
@@ -0,0 +1,26 @@
+#ifndef URING_SERVER_H
+#define URING_SERVER_H
+
+#include "channels.h"
+#include "listener.h"
+#include "signals.h"
+#include "ticker.h"
+
+#define URING_UNSUPPORTED 1
+
+/**
+* Serve connections on the listening sockets @param lsn from a single io_uring
+* instance until run is cleared. Every socket has a multishot accept armed,
+* receives draw from a provided buffer pool and replays are ring sendmsg
+* operations pointing into the channel stores of @param chans, so one
+* io_uring_enter call services every ready connection. Complete packets are
+* appended to the channel of their connection, the default one unless it
+* switched, and so are the records of @param tick, whose timer is polled
+* through the ring like the signalfd of @param sigs. Once stopped, connections
+* are served until they are between packets or the drain deadline passes.
+* @return 0 on a clean shutdown, -1 on error or URING_UNSUPPORTED if the running
+* kernel lacks the required io_uring operations and nothing was started.
+*/
+int uring_server_run(const lsn_set_t* lsn, chan_set_t* chans, ticker_t* tick, sigs_t* sigs);
+
+#endif